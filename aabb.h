@@ -4,43 +4,72 @@
 #include "rtweekend.h"
 #include "interval.h"
 
-class aabb {
+template <typename T>
+class basic_aabb {
   public:
-    interval x, y, z;
+    basic_interval<T> x, y, z;
 
-    aabb() {} // Default aabb is empty
+    basic_aabb() {} // Default aabb is empty
 
-    aabb(const point3& a, const point3& b) {
+    basic_aabb(const basic_interval<T>& x, const basic_interval<T>& y, const basic_interval<T>& z)
+      : x(x), y(y), z(z) {}
+
+    basic_aabb(const basic_vec3<T>& a, const basic_vec3<T>& b) {
         // Treat the two points a and b as extrema for the bounding box, so we don't require a
         // particular minimum/maximum coordinate order.
 
-        x = interval(fmin(a.x(), b.x()), fmax(a.x(), b.x()));
-        y = interval(fmin(a.y(), b.y()), fmax(a.y(), b.y()));
-        z = interval(fmin(a.z(), b.z()), fmax(a.z(), b.z()));
+        x = basic_interval<T>(std::fmin(a.x(), b.x()), std::fmax(a.x(), b.x()));
+        y = basic_interval<T>(std::fmin(a.y(), b.y()), std::fmax(a.y(), b.y()));
+        z = basic_interval<T>(std::fmin(a.z(), b.z()), std::fmax(a.z(), b.z()));
+
+        pad_to_minimums();
     }
 
-    aabb(const aabb& box0, const aabb& box1) {
-        x = interval(fmin(box0.x.min, box1.x.min), fmax(box0.x.max, box1.x.max));
-        y = interval(fmin(box0.y.min, box1.y.min), fmax(box0.y.max, box1.y.max));
-        z = interval(fmin(box0.z.min, box1.z.min), fmax(box0.z.max, box1.z.max));
+    basic_aabb(const basic_aabb& box0, const basic_aabb& box1) {
+        x = basic_interval<T>(std::fmin(box0.x.min, box1.x.min), std::fmax(box0.x.max, box1.x.max));
+        y = basic_interval<T>(std::fmin(box0.y.min, box1.y.min), std::fmax(box0.y.max, box1.y.max));
+        z = basic_interval<T>(std::fmin(box0.z.min, box1.z.min), std::fmax(box0.z.max, box1.z.max));
     }
 
-    const interval& axis(int n) const {
+    // Returns the smallest box of this precision that contains `box`. Narrowing conversions
+    // round each bound outward, so a ray that hits `box` always hits the result.
+    template <typename U>
+    static basic_aabb enclosing(const basic_aabb<U>& box) {
+        return basic_aabb(round_out(box.x), round_out(box.y), round_out(box.z));
+    }
+
+    const basic_interval<T>& axis(int n) const {
         if (n == 0) return x;
         if (n == 1) return y;
         return z;
     }
 
-    bool hit(const ray& r, interval ray_t) const {
+    void pad_to_minimums() {
+        // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
+        // An axis-aligned triangle otherwise gets a zero-thickness box that the slab test
+        // below always rejects.
+        T delta = T(0.0001);
+        if (x.size() < delta) x = basic_interval<T>(x.min - delta/2, x.max + delta/2);
+        if (y.size() < delta) y = basic_interval<T>(y.min - delta/2, y.max + delta/2);
+        if (z.size() < delta) z = basic_interval<T>(z.min - delta/2, z.max + delta/2);
+    }
+
+    // The slab test runs in the ray's precision. In float, each slab's exit is pushed out by
+    // the rounding error of the three operations that compute it (2 gamma(3), as in PBRT), so
+    // rounding never culls a grazing hit.
+    template <typename R>
+    bool hit(const basic_ray<R>& r, basic_interval<R> ray_t) const {
         for (int a = 0; a < 3; a++) {
-            auto invD = 1.0 / r.direction()[a];
+            auto invD = R(1) / r.direction()[a];
             auto orig = r.origin()[a];
 
-            auto t0 = (axis(a).min - orig) * invD;
-            auto t1 = (axis(a).max - orig) * invD;
+            auto t0 = (R(axis(a).min) - orig) * invD;
+            auto t1 = (R(axis(a).max) - orig) * invD;
 
-            if (invD < 0.0)
+            if (invD < 0)
                 std::swap(t0, t1);
+            if constexpr (std::is_same_v<R, float>)
+                t1 += std::fabs(t1) * 4e-7f;
 
             if (t0 > ray_t.min) ray_t.min = t0;
             if (t1 < ray_t.max) ray_t.max = t1;
@@ -50,6 +79,18 @@ class aabb {
         }
         return true;
     }
+
+  private:
+    template <typename U>
+    static basic_interval<T> round_out(const basic_interval<U>& i) {
+        T lo = T(i.min), hi = T(i.max);
+        if (U(lo) > i.min) lo = std::nextafter(lo, -std::numeric_limits<T>::infinity());
+        if (U(hi) < i.max) hi = std::nextafter(hi, +std::numeric_limits<T>::infinity());
+        return basic_interval<T>(lo, hi);
+    }
 };
 
+using aabb  = basic_aabb<double>;
+using aabbf = basic_aabb<float>;
+
 #endif
@@ -0,0 +1,160 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "rtweekend.h"
+#include "memory_ledger.h"
+
+#include <cstdint>
+#include <fstream>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Bump allocator that owns every primitive and BVH node of a scene. Objects are packed into
+// large blocks instead of one heap allocation (plus a control block) each, and the whole scene
+// is released in one step when the arena is destroyed.
+//
+// make() returns non-owning shared_ptrs (aliasing an empty owner), so the rest of the scene code
+// keeps its usual types while copies never touch a reference count. Like material_table, the
+// arena must outlive the scene built from it. Not thread-safe; give each builder thread its own
+// arena.
+//
+// Blocks are charged to the memory ledger in full when they are reserved, under the thread's
+// current memory_scope tag, and released when the arena is destroyed.
+class scene_arena {
+  public:
+    // 2 MiB blocks, aligned so the kernel can back each one with a single huge page.
+    static constexpr size_t block_size = size_t(2) << 20;
+
+    // Smaller blocks suit many short-lived arenas, such as out-of-core clusters.
+    explicit scene_arena(bool use_huge_pages = true, size_t block_bytes = block_size)
+      : use_huge_pages(use_huge_pages), block_bytes(block_bytes) {}
+
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    ~scene_arena() {
+        // Destroy in reverse order of construction, then drop the blocks wholesale.
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it)
+            it->destroy(it->object);
+        for (auto* block : blocks)
+            free_block(block);
+        for (int i = 0; i < memory_ledger::tag_count; i++)
+            memory_ledger::release(mem_tag(i), charged[i]);
+    }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        void* memory = allocate(sizeof(T), alignof(T));
+        T* object = new (memory) T(std::forward<Args>(args)...);
+
+        if constexpr (!std::is_trivially_destructible_v<T>)
+            destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+
+        return shared_ptr<T>(shared_ptr<void>(), object);
+    }
+
+    void* allocate(size_t size, size_t alignment) {
+        auto offset = (used + alignment - 1) & ~(alignment - 1);
+        if (blocks.empty() || offset + size > capacity) {
+            new_block(size + alignment);
+            offset = 0;
+        }
+
+        used = offset + size;
+        bytes_allocated += size;
+        return blocks.back() + offset;
+    }
+
+    size_t bytes_used() const { return bytes_allocated; }
+    size_t bytes_reserved() const { return bytes_reserved_total; }
+
+  private:
+    struct destructor {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    bool use_huge_pages;
+    size_t block_bytes;
+    std::vector<unsigned char*> blocks;
+    std::vector<destructor> destructors;
+    size_t used = 0;
+    size_t capacity = 0;
+    size_t bytes_allocated = 0;
+    size_t bytes_reserved_total = 0;
+    size_t charged[memory_ledger::tag_count] = {};
+
+    void new_block(size_t min_size) {
+        // Oversized requests get a block of their own, rounded up to whole blocks.
+        size_t size = (min_size + block_bytes - 1) / block_bytes * block_bytes;
+
+        auto tag = memory_scope::current();
+        memory_ledger::charge(tag, size);
+
+#if defined(_WIN32)
+        auto* block = static_cast<unsigned char*>(_aligned_malloc(size, block_bytes));
+#else
+        void* memory = nullptr;
+        if (posix_memalign(&memory, block_bytes, size) != 0)
+            memory = nullptr;
+        auto* block = static_cast<unsigned char*>(memory);
+#endif
+        if (!block) {
+            memory_ledger::release(tag, size);
+            throw std::bad_alloc();
+        }
+        charged[int(tag)] += size;
+
+#if defined(MADV_HUGEPAGE)
+        if (use_huge_pages)
+            madvise(block, size, MADV_HUGEPAGE);  // Best effort; ignored without THP
+#endif
+
+        blocks.push_back(block);
+        used = 0;
+        capacity = size;
+        bytes_reserved_total += size;
+    }
+
+    static void free_block(unsigned char* block) {
+#if defined(_WIN32)
+        _aligned_free(block);
+#else
+        free(block);
+#endif
+    }
+};
+
+// Allocates in `arena` when one is given, otherwise falls back to a shared_ptr allocation with
+// its control block. Either way the bytes are charged to the current memory_scope.
+template <typename T, typename... Args>
+inline shared_ptr<T> make_in(scene_arena* arena, Args&&... args) {
+    if (arena)
+        return arena->make<T>(std::forward<Args>(args)...);
+    return std::allocate_shared<T>(tracking_allocator<T>(), std::forward<Args>(args)...);
+}
+
+// Resident set size of this process in bytes, or 0 where it cannot be read.
+inline size_t resident_memory_bytes() {
+    std::ifstream status("/proc/self/status");
+    std::string key;
+    while (status >> key) {
+        if (key == "VmRSS:") {
+            size_t kib = 0;
+            status >> kib;
+            return kib * 1024;
+        }
+        status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return 0;
+}
+
+#endif
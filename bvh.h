@@ -6,83 +6,237 @@
 #include "aabb.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "triangle_block.h"
+#include "mesh_triangle.h"
+#include "sphere_set.h"
+#include "arena.h"
+#include "parallel.h"
 
 #include <algorithm>
 
 class bvh_node : public hittable {
   public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size()) {}
+    static inline std::atomic<size_t> built{0};  // Nodes constructed so far, for memory reports
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end) {
-        // Build the bounding box of the span of source objects.
-        aabb bbox_temp;
-        for (size_t object_index = start; object_index < end; object_index++) {
-            bbox_temp = aabb(bbox_temp, bounding_box(objects[object_index]));
-        }
-        this->bbox_bounds = bbox_temp;
+    // An object with its bounds, computed once so the build never calls bbox() while sorting.
+    struct item {
+        shared_ptr<hittable> object;
+        aabb box;
+    };
 
-        int axis = longest_axis(bbox_temp);
-        auto comparator = (axis == 0) ? box_x_compare
-                        : (axis == 1) ? box_y_compare
-                                      : box_z_compare;
+    // Nodes and packed leaves go into `arena` when one is given.
+    bvh_node(hittable_list list, scene_arena* arena = nullptr) {
+        std::vector<item> items;
+        items.reserve(list.objects.size());
+        for (const auto& object : list.objects)
+            items.push_back(make_item(object));
 
-        size_t object_span = end - start;
+        build(items, 0, items.size(), arena);
+    }
 
-        if (object_span == 1) {
-            left = right = objects[start];
-        } else if (object_span == 2) {
-            left = objects[start];
-            right = objects[start+1];
-        } else {
-            std::sort(objects.begin() + start, objects.begin() + end, comparator);
+    bvh_node(std::vector<item>& items, size_t start, size_t end, scene_arena* arena) {
+        build(items, start, end, arena);
+    }
+
+    // An inner node over two finished subtrees.
+    bvh_node(shared_ptr<hittable> left, shared_ptr<hittable> right, const aabb& box)
+      : left(left), right(right), bbox_bounds(basic_aabb<traversal_real>::enclosing(box)) {
+        built++;
+    }
 
-            auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+    static item make_item(shared_ptr<hittable> object) {
+        return {object, bounding_box(object)};
+    }
+
+    // Builds the same tree as bvh_node(items, 0, items.size(), ...) with `threads` threads
+    // (0 = every hardware thread). The top levels are split here, then the subtrees below them
+    // are built concurrently. With `arenas`, each subtree and the top levels get an arena of
+    // their own, appended to `arenas`. Returns null when there are no items.
+    static shared_ptr<hittable> build_parallel(std::vector<item>& items,
+                                               std::vector<std::unique_ptr<scene_arena>>* arenas,
+                                               int threads = 0) {
+        if (items.empty())
+            return nullptr;
+
+        // A few subtrees per thread balance the load; each is large enough to amortize a task.
+        int workers = worker_count(threads, items.size() / (16 * leaf_width));
+        size_t grain = workers == 1 ? items.size()
+                                    : std::max(items.size() / (4 * size_t(workers)), 16 * leaf_width);
+
+        std::vector<plan_node> nodes;
+        std::vector<int> tasks;
+        plan(items, 0, items.size(), grain, nodes, tasks);
+
+        std::vector<scene_arena*> task_arenas(tasks.size() + 1, nullptr);
+        if (arenas) {
+            for (auto& arena : task_arenas) {
+                arenas->push_back(std::make_unique<scene_arena>());
+                arena = arenas->back().get();
+            }
         }
+
+        auto tag = memory_scope::current();
+        std::vector<shared_ptr<hittable>> subtrees(tasks.size());
+        parallel_for(tasks.size(), workers, [&](size_t i) {
+            memory_scope scope(tag);
+            const auto& node = nodes[tasks[i]];
+            subtrees[i] = make_in<bvh_node>(task_arenas[i], items, node.start, node.end, task_arenas[i]);
+        });
+
+        if (nodes.size() == 1)
+            return subtrees[0];
+
+        scene_arena* top_arena = task_arenas.back();
+        auto join = [&](auto& self, int index) -> shared_ptr<hittable> {
+            const auto& node = nodes[index];
+            if (node.task >= 0)
+                return subtrees[node.task];
+            return make_in<bvh_node>(top_arena, self(self, node.left), self(self, node.right),
+                                     span_bounds(items, node.start, node.end));
+        };
+        return join(join, 0);
     }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        if (!bbox_bounds.hit(r, ray_t))
+        if constexpr (std::is_same_v<traversal_real, float>) {
+            // Float boxes are tested in float. The boxes are rounded outward and the slab test
+            // pads its exits, so rounding the ray can only let through a box it grazes.
+            if (!bbox_bounds.hit(rayf(r), intervalf(float(ray_t.min), float(ray_t.max))))
+                return false;
+        } else if (!bbox_bounds.hit(r, ray_t)) {
             return false;
+        }
 
         bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+        bool hit_right = right && right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
 
         return hit_left || hit_right;
     }
 
     void bbox(hit_record& rec) const override {
-        rec.bbox_ptr = new aabb(this->bbox_bounds);
+        rec.bbox_ptr = new aabb(aabb::enclosing(this->bbox_bounds));
     }
 
   private:
     shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox_bounds;
+    shared_ptr<hittable> right;  // Null when `left` is a packed leaf
+    basic_aabb<traversal_real> bbox_bounds;  // Rounded outward when traversal_real is float
+
+    // Primitives per packed leaf. Both leaf types fill one SIMD register.
+    static constexpr size_t leaf_width = triangle_block::width;
+    static_assert(sphere_set::width == triangle_block::width);
+
+    void build(std::vector<item>& items, size_t start, size_t end, scene_arena* arena) {
+        // Build the bounding box of the span of source objects.
+        aabb bbox_temp;
+        for (size_t object_index = start; object_index < end; object_index++) {
+            bbox_temp = aabb(bbox_temp, items[object_index].box);
+        }
+        this->bbox_bounds = basic_aabb<traversal_real>::enclosing(bbox_temp);
+        built++;
+
+        int axis = longest_axis(bbox_temp);
+
+        size_t object_span = end - start;
 
-    static bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-        aabb box_a = bounding_box(a);
-        aabb box_b = bounding_box(b);
-        return box_a.axis(axis).min < box_b.axis(axis).min;
+        if (object_span <= size_t(leaf_width) && make_packed_leaf(items, start, end, arena)) {
+            return;
+        }
+
+        if (object_span == 1) {
+            left = right = items[start].object;
+        } else if (object_span == 2) {
+            left = items[start].object;
+            right = items[start+1].object;
+        } else {
+            auto mid = split(items, start, end, axis);
+            left = make_in<bvh_node>(arena, items, start, mid, arena);
+            right = make_in<bvh_node>(arena, items, mid, end, arena);
+        }
     }
 
-    static bool box_x_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 0);
+    // Partitions the span along `axis` and returns where it divides into the two children.
+    static size_t split(std::vector<item>& items, size_t start, size_t end, int axis) {
+        // Round the split to whole leaf blocks so triangle leaves come out full.
+        auto object_span = end - start;
+        auto half = object_span / 2;
+        auto rounded = (half + leaf_width - 1) / leaf_width * leaf_width;
+        auto mid = start + (rounded < object_span ? rounded : half);
+
+        // Each child orders its own span again, so only the partition matters: a selection
+        // is linear where a full sort is not.
+        std::nth_element(items.begin() + start, items.begin() + mid, items.begin() + end,
+                         [axis](const item& a, const item& b) {
+                             return a.box.axis(axis).min < b.box.axis(axis).min;
+                         });
+        return mid;
+    }
+
+    static aabb span_bounds(const std::vector<item>& items, size_t start, size_t end) {
+        aabb box;
+        for (size_t i = start; i < end; i++)
+            box = aabb(box, items[i].box);
+        return box;
+    }
+
+    // A node of the parallel build plan: either two planned children or a subtree task.
+    struct plan_node {
+        size_t start, end;
+        int left = -1, right = -1;  // Indices into the plan, or -1 for a subtree task
+        int task = -1;
+    };
+
+    static int plan(std::vector<item>& items, size_t start, size_t end, size_t grain,
+                    std::vector<plan_node>& nodes, std::vector<int>& tasks) {
+        int index = int(nodes.size());
+        nodes.push_back({start, end});
+
+        // Stop where the serial build would make a leaf, so the result is the same tree.
+        if (end - start <= grain || end - start <= 2) {
+            nodes[index].task = int(tasks.size());
+            tasks.push_back(index);
+            return index;
+        }
+
+        auto mid = split(items, start, end, longest_axis(span_bounds(items, start, end)));
+        int left_index = plan(items, start, mid, grain, nodes, tasks);
+        int right_index = plan(items, mid, end, grain, nodes, tasks);
+        nodes[index].left = left_index;
+        nodes[index].right = right_index;
+        return index;
     }
 
-    static bool box_y_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 1);
+    bool make_packed_leaf(std::vector<item>& items, size_t start, size_t end, scene_arena* arena) {
+        // Packs the span into one triangle_block, mesh_triangle_block or sphere_set if every
+        // object in it has the same primitive type.
+        if (auto block = pack<triangle, triangle_block>(items, start, end, arena))
+            left = block;
+        else if (auto mapped = pack<mesh_triangle, mesh_triangle_block>(items, start, end, arena))
+            left = mapped;
+        else if (auto set = pack<sphere, sphere_set>(items, start, end, arena))
+            left = set;
+        else
+            return false;
+
+        right = nullptr;
+        return true;
     }
 
-    static bool box_z_compare (const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-        return box_compare(a, b, 2);
+    template <typename Prim, typename Leaf>
+    static shared_ptr<Leaf> pack(std::vector<item>& items, size_t start, size_t end, scene_arena* arena) {
+        std::vector<shared_ptr<Prim>> prims;
+        for (size_t i = start; i < end; i++) {
+            auto prim = std::dynamic_pointer_cast<Prim>(items[i].object);
+            if (!prim)
+                return nullptr;
+            prims.push_back(prim);
+        }
+        return make_in<Leaf>(arena, prims);
     }
 
     static aabb bounding_box(const shared_ptr<hittable> object) {
         // Hack to get bounding box from any hittable
         hit_record rec;
-        ray r(point3(0,0,0), vec3(1,0,0));
         object->bbox(rec);
         if (rec.bbox_ptr) {
             aabb result = *rec.bbox_ptr;
@@ -3,6 +3,25 @@
 
 #include "hittable.h"
 #include "material.h"
+#include "light_list.h"
+#include "lod_group.h"
+#include "environment_map.h"
+#include "framebuffer.h"
+#include "denoiser.h"
+#include "frame_stream.h"
+#include "guiding.h"
+#include "photon_map.h"
+#include "png_writer.h"
+#include "sampler.h"
+#include "temporal.h"
+#include "warp.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class camera {
   public:
@@ -10,6 +29,7 @@ class camera {
     int    image_width  = 100;  // Rendered image width in pixel count
     int    samples_per_pixel = 10;   // Count of random samples for each pixel
     int    max_depth         = 10;   // Maximum number of ray bounces into scene
+    int    roulette_depth    = 3;    // Bounces before Russian roulette may end a path
 
     double vfov = 90;
 
@@ -20,55 +40,291 @@ class camera {
     double defocus_angle = 0;  // Variation angle of rays through each pixel
     double focus_dist = 10;    // Distance from camera lookfrom point to plane of perfect focus
 
-    void render(const hittable& world) {
-    initialize();
+    int    threads = 0;  // Render threads; 0 uses every hardware thread
+
+    sampler_type sampling = sampler_type::sobol;  // Source of the pixel, lens and bounce samples
+
+    bool   sky = true;              // Light escaping rays with the sky gradient
+    color  background = color(0,0,0);  // Radiance of escaping rays when sky is off
+    const environment_map* environment = nullptr;  // Lights escaping rays instead of the sky
+
+    const light_list* lights = nullptr;  // Emitters in the scene
+    std::vector<lod_group*> lod_groups;  // Pick their level from this camera's view at each render
+    bool   next_event = true;       // Sample the lights and the environment map with shadow rays
+
+    std::string   png_output = "output.png";  // PNG written as bands finish; empty for none
+    frame_stream* raw_frames = nullptr;       // Also stream raw tiles here as they finish
+
+    bool        denoise = false;   // Filter the finished image, guided by first-hit features
+    denoiser    filter;            // Settings of that filter
+    std::string feature_output;    // Write the albedo, normal and depth buffers as <prefix>_*.pfm
+
+    bool   guiding = false;        // Learn where light comes from and aim diffuse and glossy bounces there
+    double guide_fraction = 0.25;  // Share of guided bounces drawn from the learned distribution
+
+    int    caustic_photons = 0;    // Photons traced from the lights for caustics; 0 for none
+    double caustic_radius = 0;     // Photon gather radius; 0 picks one from the photon density
 
-    std::vector<unsigned char> image_data(image_width * image_height * 3);
+    bool   temporal_reuse = false; // Animation: add the previous render's samples where it saw the same surfaces
+    double history_frames = 8;     // Frames' worth of samples the history may carry
+    frame_history history;         // Kept from one render to the next
 
-    for (int j = 0; j < image_height; j++) {
-        std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-        for (int i = 0; i < image_width; i++) {
-            color pixel_color(0, 0, 0);
-            for (int sample = 0; sample < samples_per_pixel; sample++) {
-                ray r = get_ray(i, j);
-                pixel_color += ray_color(r, max_depth, world);
+    void render(const hittable& world) {
+        initialize();
+        for (auto* group : lod_groups)
+            group->set_view(center, pixel_spread);
+        auto start = std::chrono::steady_clock::now();
+
+        // Each render scrambles its sample sequences differently, so the frames of an animation
+        // draw new samples rather than repeating the previous frame's, and the history that
+        // temporal reuse carries over averages their noise out instead of reinforcing it.
+        uint32_t seed = render_count++;
+
+        // Threads pull 32x32 tiles from a shared counter, trace them into a private tile buffer
+        // and merge it into the framebuffer when the tile is done. The thread that completes a
+        // row of tiles also quantizes and compresses that band of the PNG, so encoding overlaps
+        // with rendering instead of following it.
+        //
+        // With denoising or temporal reuse on, the whole image is needed before it is final,
+        // so the PNG and the raw tiles are only written at the end.
+        //
+        // With guiding on, the image is rendered in passes of 1, 2, 4, ... samples per pixel
+        // that train the guide for the next one, until a quarter of the samples are spent; the
+        // last pass takes the rest. Every pass adds to the image, and only the last one streams.
+        framebuffer image(image_width, image_height);
+        std::vector<int> passes = pass_plan();
+        bool whole_image = denoise || temporal_reuse;
+        std::unique_ptr<path_guide> trained_guide;
+        if (guiding) {
+            hit_record box_rec;
+            world.bbox(box_rec);
+            if (box_rec.bbox_ptr) {
+                trained_guide = std::make_unique<path_guide>(*box_rec.bbox_ptr);
+                delete box_rec.bbox_ptr;
             }
-            pixel_color *= pixel_samples_scale;
-
-            // Converte para RGB 0–255
-            int ir = static_cast<int>(256 * clamp(pixel_color.x(), 0.0, 0.999));
-            int ig = static_cast<int>(256 * clamp(pixel_color.y(), 0.0, 0.999));
-            int ib = static_cast<int>(256 * clamp(pixel_color.z(), 0.0, 0.999));
-
-            // Inverte a ordem das linhas para o stbi_write_png
-            int row = image_height - 1 - j;
-            int index = (row * image_width + i) * 3;
-            image_data[index + 0] = ir;
-            image_data[index + 1] = ig;
-            image_data[index + 2] = ib;
         }
-    }
+        guide = trained_guide.get();
+
+        // Caustics come from a photon map traced before the image.
+        std::unique_ptr<photon_map> caustic_map;
+        if (caustic_photons > 0 && lights && !lights->empty()) {
+            auto photon_start = std::chrono::steady_clock::now();
+            caustic_map = std::make_unique<photon_map>(world, *lights, size_t(caustic_photons), max_depth,
+                                                       caustic_radius, sampling, seed, threads);
+            std::chrono::duration<double> photon_time = std::chrono::steady_clock::now() - photon_start;
+            std::clog << "Photon map: " << caustic_map->size() << " caustic photons of " << caustic_photons
+                      << " emitted, radius " << caustic_map->radius() << ", in "
+                      << photon_time.count() * 1000 << " ms\n";
+        }
+        caustics = caustic_map.get();
+        std::unique_ptr<feature_buffer> features;
+        if (denoise || temporal_reuse || !feature_output.empty())
+            features = std::make_unique<feature_buffer>(image_width, image_height);
+        std::unique_ptr<png_stream> png;
+        if (!png_output.empty() && !whole_image)
+            png = std::make_unique<png_stream>(png_output, image_width, image_height, framebuffer::tile_size);
+        if (raw_frames)
+            raw_frames->begin_frame(image_width, image_height, framebuffer::tile_size);
+        std::vector<std::atomic<int>> tiles_left(size_t(image.tiles_y()));
+        for (auto& row : tiles_left)
+            row = image.tiles_x();
+        std::atomic<int> next_tile(0);
+        std::atomic<size_t> total_rays(0);
+        std::mutex progress_mutex;
+        int tiles_done = 0;
+
+        // The pass being rendered.
+        int pass_samples = 0, first_sample = 0;
+        bool last_pass = false;
+        frame_stream* tile_stream = nullptr;
+        png_stream* png_bands = nullptr;
+
+        int thread_count = threads > 0 ? threads : int(std::thread::hardware_concurrency());
+        thread_count = std::max(1, std::min(thread_count, image.tile_count()));
+
+        // Each thread's tile and PNG band are charged to the memory ledger here, on the calling
+        // thread, so running over the budget fails the render instead of a worker. Anything a
+        // worker still throws (an out-of-core cluster read, say) stops the others and is
+        // rethrown once they are done.
+        struct worker_buffers {
+            std::unique_ptr<framebuffer::tile_buffer> tile = std::make_unique<framebuffer::tile_buffer>();
+            tracked_vector<unsigned char> band{tracking_allocator<unsigned char>(mem_tag::io)};
+        };
+        std::vector<worker_buffers> buffers(static_cast<size_t>(thread_count));
+        if (png)
+            for (auto& b : buffers)
+                b.band.resize(size_t(framebuffer::tile_size) * image_width * 3);
+
+        std::atomic<bool> failed(false);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        auto render_tiles = [&](int n) {
+            auto& tile = buffers[size_t(n)].tile;
+            auto& band = buffers[size_t(n)].band;
+            rays_traced = 0;
+
+            // Samplers derive their values from the pixel, not the thread, so the image does not
+            // depend on which thread renders which tile (except through the independent fallback).
+            auto pixel_sampler = sampler::make(sampling, seed);
+            sampler::scope active_sampler(pixel_sampler.get());
+
+            for (int t = next_tile++; t < image.tile_count() && !failed; t = next_tile++) {
+                tile->reset(image, t);
+                for (int j = tile->y0; j < tile->y0 + tile->h; j++) {
+                    for (int i = tile->x0; i < tile->x0 + tile->w; i++) {
+                        color pixel_color(0, 0, 0);
+                        feature_sample pixel_features;
+                        for (int sample = first_sample; sample < first_sample + pass_samples; sample++) {
+                            pixel_sampler->start(i, j, sample);
+                            ray r = get_ray(i, j);
+                            if (!features) {
+                                pixel_color += ray_color(r, max_depth, world);
+                                continue;
+                            }
+                            feature_sample first;
+                            color sample_color = ray_color(r, max_depth, world, &first);
+                            first.luminance_squared = luminance(sample_color) * luminance(sample_color);
+                            pixel_features.add(first);
+                            pixel_color += sample_color;
+                        }
+                        tile->add(i, j, pixel_color, pass_samples);
+                        if (features)
+                            features->add(i, j, pixel_features);
+                    }
+                }
+
+                // Tiles own whole cache lines of the framebuffer, so merges need no lock.
+                image.merge(*tile);
+
+                if (tile_stream)
+                    tile_stream->add_tile(image, tile->x0, tile->y0, tile->w, tile->h);
+
+                int tile_row = tile->y0 / framebuffer::tile_size;
+                if (png_bands && --tiles_left[tile_row] == 0) {
+                    int y1 = std::min(tile->y0 + framebuffer::tile_size, image_height);
+                    image.to_rgb8(tile->y0, y1, band.data());
+                    png_bands->add_band(tile_row, band.data());
+                }
+
+                std::lock_guard<std::mutex> lock(progress_mutex);
+                tiles_done++;
+                std::clog << "\rTiles remaining: " << (image.tile_count() - tiles_done) << "   " << std::flush;
+            }
+
+            total_rays += rays_traced;
+        };
+
+        auto worker = [&](int n) {
+            try {
+                render_tiles(n);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        };
+
+        for (size_t pass = 0; pass < passes.size(); pass++) {
+            pass_samples = passes[pass];
+            last_pass = pass + 1 == passes.size();
+            guide_training = guide && !last_pass;
+            tile_stream = last_pass && !whole_image ? raw_frames : nullptr;
+            png_bands = last_pass ? png.get() : nullptr;
+            next_tile = 0;
+            tiles_done = 0;
+            if (passes.size() > 1)
+                std::clog << "\rPass " << (pass + 1) << "/" << passes.size() << " (" << pass_samples
+                          << " samples per pixel)\n";
+
+            std::vector<std::thread> pool;
+            for (int n = 1; n < thread_count; n++)
+                pool.emplace_back(worker, n);
+            worker(0);
+            for (auto& thread : pool)
+                thread.join();
+            if (error)
+                std::rethrow_exception(error);
+
+            if (guide_training)
+                guide->refine(pass_samples, threads);
+            first_sample += pass_samples;
+        }
+        if (guide)
+            std::clog << "\nGuide: " << guide->region_count() << " regions";
+        guide = nullptr;
+        guide_training = false;
+        caustics = nullptr;
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        size_t ray_count = total_rays;
+        std::clog << "\nDone. " << ray_count << " rays ("
+                  << double(ray_count) / (double(image_width) * image_height * samples_per_pixel)
+                  << " per sample), " << (ray_count / elapsed.count()) * 1e-6 << " Mrays/s ("
+                  << thread_count << " threads)\n";
+
+        if (!feature_output.empty() && !features->write(feature_output, image))
+            std::cerr << "Error: could not write the feature buffers " << feature_output << "_*.pfm\n";
+
+        if (temporal_reuse) {
+            frame_history::view current{center, pixel00_loc, pixel_delta_u, pixel_delta_v};
+            size_t reused = history.accumulate(image, *features, current, history_frames * samples_per_pixel, threads);
+            std::clog << "History reused for " << 100.0 * double(reused) / (double(image_width) * image_height)
+                      << "% of the pixels\n";
+        }
+
+        if (denoise) {
+            auto filter_start = std::chrono::steady_clock::now();
+            filter.apply(image, *features, threads);
+            std::chrono::duration<double> filter_time = std::chrono::steady_clock::now() - filter_start;
+            std::clog << "Denoised in " << filter_time.count() * 1000 << " ms ("
+                      << worker_count(threads, size_t(image_height)) << " threads)\n";
+        }
 
-    // Salva a imagem corretamente flipando primeiro
-    stbi_flip_vertically_on_write(1);
-    stbi_write_png("output.png", image_width, image_height, 3, image_data.data(), image_width * 3);
+        if (whole_image) {
+            if (!png_output.empty()) {
+                auto rgb = image.to_rgb8();
+                if (!png_stream::write(png_output, image_width, image_height, rgb.data(), threads))
+                    std::cerr << "Error: could not write " << png_output << "\n";
+            }
+            if (raw_frames)
+                for (int t = 0; t < image.tile_count(); t++) {
+                    int x0 = (t % image.tiles_x()) * framebuffer::tile_size;
+                    int y0 = (t / image.tiles_x()) * framebuffer::tile_size;
+                    raw_frames->add_tile(image, x0, y0, std::min(framebuffer::tile_size, image_width - x0),
+                                         std::min(framebuffer::tile_size, image_height - y0));
+                }
+        }
 
-    std::clog << "\nDone.\n";
-}
+        if (png && !png->finish())
+            std::cerr << "\nError: could not write " << png_output << "\n";
+        if (raw_frames)
+            raw_frames->end_frame();
+    }
 
   private:
+    path_guide* guide = nullptr;   // Guide of the render in progress
+    const photon_map* caustics = nullptr;  // Caustic photons of the render in progress
+    bool   guide_training = false; // Record radiance into it during this pass
+    uint32_t render_count = 0;     // Renders so far, which seeds the next one's samples
+
     int    image_height;   // Rendered image height
     point3 center;         // Camera center
     point3 pixel00_loc;    // Location of pixel 0, 0
     double pixel_samples_scale;  // Color scale factor for a sum of pixel samples
     vec3   pixel_delta_u;  // Offset to pixel to the right
     vec3   pixel_delta_v;  // Offset to pixel below
+    double pixel_spread;   // Angular size of a pixel, in radians
 
     vec3   u, v, w;              // Camera frame basis vectors
 
     vec3   defocus_disk_u;       // Defocus disk horizontal radius
     vec3   defocus_disk_v;       // Defocus disk vertical radius
 
+    // Rays traced by the current thread, summed after each render for throughput reports.
+    static inline thread_local size_t rays_traced = 0;
+
     void initialize() {
         image_height = int(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
@@ -102,18 +358,15 @@ class camera {
         auto viewport_upper_left = center - (focal_length * w) - viewport_u/2 - viewport_v/2;
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
 
+        // Angle subtended by one pixel, which level-of-detail groups measure themselves in.
+        pixel_spread = pixel_delta_u.length() / focal_length;
+
         // Calculate the camera defocus disk basis vectors.
         auto defocus_radius = focus_dist * std::tan(degrees_to_radians(defocus_angle / 2));
         defocus_disk_u = u * defocus_radius;
         defocus_disk_v = v * defocus_radius;
     }
 
-    double clamp(double x, double min, double max){
-        if (x < min) return min;
-        if (x > max) return max;
-        return x;
-    }
-    
     ray get_ray(int i, int j) const {
         // Construct a camera ray originating from the defocus disk and directed at a randomly
         // sampled point around the pixel location i, j.
@@ -131,34 +384,258 @@ class camera {
 
     vec3 sample_square() const {
         // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+        auto s = sample_2d();
+        return vec3(s.u - 0.5, s.v - 0.5, 0);
     }
     
     point3 defocus_disk_sample() const {
         // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+        auto p = uniform_disk(sample_2d());
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 
-    color ray_color(const ray& r, int depth, const hittable& world) const {
-        // If we've exceeded the ray bounce limit, no more light is gathered.
-        if (depth <= 0)
-            return color(0,0,0);
-            
-        hit_record rec;
+    // Follows one path iteratively, carrying the product of the attenuations so far. After
+    // `roulette_depth` bounces each bounce survives with probability equal to the largest
+    // throughput component, and survivors are reweighted by its inverse, so the estimate stays
+    // unbiased while paths whose throughput is near zero almost always end right away.
+    //
+    // With next_event on, every bounce off a material with a scattering pdf also aims a shadow
+    // ray at a random light or, with an environment map, at a direction drawn from it
+    // (next-event estimation). Emitters are then reached both ways, and each contribution is
+    // weighted with the power heuristic against the other strategy's density.
+    //
+    // With a caustic photon map, every diffuse surface a path meets adds the caustic light the
+    // photons found around it, and light that the path then reaches from there only through
+    // specular surfaces is left out, since the photons already carried it.
+    //
+    // With a guide, bounces off materials with a scattering pdf pick their direction from the
+    // guide's trained distribution with probability guide_fraction and from the material
+    // otherwise, and are weighted by the density of that mixture. While the guide trains, each
+    // such bounce also records the radiance its path went on to find.
+    //
+    // If `first` is given, it receives the features of the first surface the camera ray hits.
+    color ray_color(const ray& r_in, int depth, const hittable& world, feature_sample* first = nullptr) const {
+        ray r = r_in;
+        color throughput(1, 1, 1);
+        color radiance(0, 0, 0);
+        double scatter_pdf = 0;  // Density of the bounce that produced r; 0 if it can't be light sampled
+        point3 scatter_origin;
+        bool direct = next_event && ((lights && !lights->empty()) || environment);
+        bool caustic_path = false;            // Only specular surfaces since the photon map was last queried
+        bool specular_since_diffuse = false;  // And at least one of them
+        if (guide_training)
+            guide_trail.clear();
+
+        for (int bounce = 0; bounce < depth; bounce++) {
+            if (auto s = sampler::current())
+                s->start_bounce(bounce);
+            hit_record rec;
+
+            rays_traced++;
+            if (!world.hit(r, interval(0.001, infinity), rec)) {
+                double weight = 1;
+                if (scatter_pdf > 0 && environment)
+                    weight = power_heuristic(scatter_pdf, environment_probability() * environment->pdf_value(r.direction()));
+                radiance += throughput * escaped(r) * weight;
+                break;
+            }
+
+            rec.complete(r);
+            if (first && bounce == 0) {
+                first->albedo = rec.mat->feature_albedo();
+                first->normal = rec.normal;
+                first->depth = rec.t * r.direction().length();
+                first->hits = 1;
+            }
+
+            color emission = rec.mat->emitted(r, rec);
+            bool in_photon_map = caustic_path && specular_since_diffuse && lights->contains(rec.object);
+            if (!emission.near_zero() && !in_photon_map) {
+                double weight = 1;
+                if (scatter_pdf > 0 && lights && lights->contains(rec.object)) {
+                    double light_pdf = (1 - environment_probability())
+                                     * lights->pdf_value(*rec.object, scatter_origin, r.direction());
+                    weight = power_heuristic(scatter_pdf, light_pdf);
+                }
+                radiance += throughput * emission * weight;
+
+                // Light sampling already finds emitters well, so with it on the guide only
+                // learns the light that arrives after further bounces.
+                if (direct && guide_training && !guide_trail.empty() && guide_trail.back().bounce + 1 == bounce)
+                    guide_trail.back().radiance_before = radiance;
+            }
 
-        if (world.hit(r, interval(0.001, infinity), rec)) { 
             ray scattered;
             color attenuation;
-            if (rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth-1, world);
-            return color(0,0,0);
+            bool sampled = rec.mat->scatter(r, rec, attenuation, scattered);
+            bool smooth = rec.mat->has_scattering_pdf();
+            const path_guide::region* leaf = nullptr;
+            if (guide && smooth) {
+                leaf = &guide->find(rec.p);
+                if (!leaf->trained())
+                    leaf = nullptr;
+            }
+
+            // Light sampling doesn't depend on the bounce direction, so it runs even when the
+            // material's own sample went below the surface.
+            bool specular = rec.mat->specular();
+            if (direct && smooth && !(caustic_path && specular))
+                radiance += throughput * sample_light(r, rec, attenuation, world, leaf);
+
+            specular_since_diffuse = specular;
+            if (!specular) {
+                caustic_path = caustics && smooth;
+                if (caustic_path)
+                    radiance += throughput * caustics->estimate(r, rec, attenuation);
+            }
+
+            scatter_pdf = 0;
+            if (leaf) {
+                if (sample_1d() < guide_fraction)
+                    scattered = ray(rec.p, guide->sample(*leaf, sample_2d()));
+                else if (!sampled)
+                    break;
+                double material_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+                if (material_pdf <= 0)
+                    break;
+                double pdf = guided_pdf(*leaf, material_pdf, scattered.direction());
+                attenuation = attenuation * (material_pdf / pdf);
+                if (direct)
+                    scatter_pdf = pdf;
+            } else {
+                if (!sampled)
+                    break;
+                if (direct && smooth)
+                    scatter_pdf = rec.mat->scattering_pdf(r, rec, scattered);
+            }
+            scatter_origin = rec.p;
+
+            throughput = throughput * attenuation;
+            if (bounce + 1 >= roulette_depth) {
+                double survival = std::fmin(1.0, std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())));
+                if (survival <= 0 || sample_1d() >= survival)
+                    break;
+                throughput = throughput / survival;
+            }
+
+            if (guide_training && smooth) {
+                double pdf = leaf ? guided_pdf(*leaf, rec.mat->scattering_pdf(r, rec, scattered), scattered.direction())
+                                  : rec.mat->scattering_pdf(r, rec, scattered);
+                if (pdf > 0)
+                    guide_trail.push_back({rec.p, scattered.direction(), pdf, throughput, radiance, bounce});
+            }
+
+            r = scattered;
         }
 
+        // Past the bounce limit no more light is gathered. What each guided vertex's path found
+        // after it, divided by the throughput up to it, is the radiance it received from its
+        // bounce direction.
+        if (guide_training)
+            for (const auto& vertex : guide_trail) {
+                color found = radiance - vertex.radiance_before;
+                color incident(vertex.throughput.x() > 0 ? found.x() / vertex.throughput.x() : 0,
+                               vertex.throughput.y() > 0 ? found.y() / vertex.throughput.y() : 0,
+                               vertex.throughput.z() > 0 ? found.z() / vertex.throughput.z() : 0);
+                guide->record(vertex.p, vertex.direction, luminance(incident) / vertex.pdf);
+            }
+        return radiance;
+    }
+
+    // A bounce that ray_color may hand to the guide once its path is complete.
+    struct guide_vertex {
+        point3 p;
+        vec3   direction;
+        double pdf;              // Density the direction was drawn with
+        color  throughput;       // Path throughput including this bounce
+        color  radiance_before;  // Radiance gathered before the bounce
+        int    bounce;
+    };
+
+    static inline thread_local std::vector<guide_vertex> guide_trail;
+
+    // Density of a guided bounce: the mixture of the guide's and the material's distributions.
+    double guided_pdf(const path_guide::region& leaf, double material_pdf, const vec3& direction) const {
+        return guide_fraction * guide->pdf(leaf, direction) + (1 - guide_fraction) * material_pdf;
+    }
+
+    // Samples per pixel of each pass. Without guiding, a single pass.
+    std::vector<int> pass_plan() const {
+        std::vector<int> passes;
+        int remaining = samples_per_pixel;
+        if (guiding)
+            for (int pass = 1; 4 * (samples_per_pixel - remaining + pass) <= samples_per_pixel; pass *= 2) {
+                passes.push_back(pass);
+                remaining -= pass;
+            }
+        passes.push_back(remaining);
+        return passes;
+    }
+
+    color escaped(const ray& r) const {
+        if (environment)
+            return environment->radiance(r.direction());
+        if (!sky)
+            return background;
         vec3 unit_direction = unit_vector(r.direction());
         auto a = 0.5*(unit_direction.y() + 1.0);
         return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
     }
+
+    // Probability that a shadow ray samples the environment map rather than the light list.
+    double environment_probability() const {
+        if (!environment)
+            return 0;
+        return (lights && !lights->empty()) ? 0.5 : 1.0;
+    }
+
+    // Light reflected at `rec` from one randomly chosen light or environment direction,
+    // through a shadow ray.
+    // With a trained guide region `leaf`, the bounce direction was drawn from the guided
+    // mixture, so that density is what the light sample is weighted against.
+    color sample_light(const ray& r_in, const hit_record& rec, const color& attenuation,
+                       const hittable& world, const path_guide::region* leaf = nullptr) const {
+        double environment_chance = environment_probability();
+        bool from_environment = sample_1d() < environment_chance;
+
+        const hittable* light = nullptr;
+        ray shadow(rec.p, from_environment ? environment->random() : lights->random(rec.p, light));
+
+        double light_pdf = from_environment
+                         ? environment_chance * environment->pdf_value(shadow.direction())
+                         : (1 - environment_chance) * lights->pdf_value(*light, rec.p, shadow.direction());
+        double material_pdf = rec.mat->scattering_pdf(r_in, rec, shadow);
+        if (light_pdf <= 0 || material_pdf <= 0)
+            return color(0,0,0);
+        double scatter_pdf = leaf ? guided_pdf(*leaf, material_pdf, shadow.direction()) : material_pdf;
+
+        // The light only contributes if it is the first thing the shadow ray meets; the
+        // environment only if the ray meets nothing.
+        hit_record light_rec;
+        rays_traced++;
+        bool blocked = world.hit(shadow, interval(0.001, infinity), light_rec);
+
+        color emission;
+        if (from_environment) {
+            if (blocked)
+                return color(0,0,0);
+            emission = environment->radiance(shadow.direction());
+        } else {
+            if (!blocked)
+                return color(0,0,0);
+            light_rec.complete(shadow);
+            if (light_rec.object != light)
+                return color(0,0,0);
+            emission = light_rec.mat->emitted(shadow, light_rec);
+        }
+
+        double weight = power_heuristic(light_pdf, scatter_pdf) / light_pdf;
+        return attenuation * emission * (material_pdf * weight);
+    }
+
+    static double power_heuristic(double pdf, double other_pdf) {
+        return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,455 @@
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "memory_ledger.h"
+#include "mesh_file.h"
+#include "mesh_triangle.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Out-of-core meshes.
+//
+// A cluster file (.rtclusters, written by obj2mesh --clusters) holds a mesh cut into spatially
+// coherent clusters. A header and a table of cluster bounds come first; each cluster follows as
+// a self-contained .rtmesh image (local vertex indices) starting on a 4 KiB boundary, so it is
+// read with one contiguous request. At render time only the table is resident: clusters are
+// read, given a BVH and cached on demand by a cluster_cache under a memory cap.
+
+struct cluster_file_header {
+    static constexpr char file_magic[8] = {'R', 'T', 'C', 'L', 'U', 'S', 'T', '\0'};
+    static constexpr uint32_t current_version = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t cluster_count;
+    uint64_t table_offset;  // cluster_count cluster_entry records
+    uint64_t triangle_count;
+};
+
+struct cluster_entry {
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t triangle_count;
+    uint32_t reserved;
+    uint64_t offset;  // Mesh image of the cluster
+    uint64_t size;
+};
+
+static_assert(sizeof(cluster_file_header) == 32 && sizeof(cluster_entry) == 48,
+              "cluster file records must keep their layout");
+
+// Splits `mesh` into clusters of at most `max_triangles` triangles by recursive median splits
+// of the triangle centroids along the longest axis, and writes them to `path`.
+inline bool write_clusters(const std::string& path, const mesh_arrays& mesh, size_t max_triangles) {
+    constexpr size_t page = 4096;
+    constexpr float inf = std::numeric_limits<float>::infinity();
+    size_t triangle_count = mesh.indices.size() / 3;
+    bool with_normals = !mesh.normals.empty();
+
+    auto vertex = [&](size_t tri, int corner, int axis) {
+        return mesh.positions[3 * mesh.indices[3 * tri + corner] + axis];
+    };
+    auto centroid = [&](size_t tri, int axis) {
+        return vertex(tri, 0, axis) + vertex(tri, 1, axis) + vertex(tri, 2, axis);
+    };
+
+    std::vector<uint32_t> order(triangle_count);
+    for (size_t i = 0; i < triangle_count; i++)
+        order[i] = uint32_t(i);
+
+    std::vector<std::pair<size_t, size_t>> spans;
+    auto partition = [&](auto& self, size_t start, size_t end) -> void {
+        if (end - start <= max_triangles) {
+            spans.push_back({start, end});
+            return;
+        }
+
+        float lo[3] = {inf, inf, inf}, hi[3] = {-inf, -inf, -inf};
+        for (size_t i = start; i < end; i++) {
+            for (int a = 0; a < 3; a++) {
+                lo[a] = std::min(lo[a], centroid(order[i], a));
+                hi[a] = std::max(hi[a], centroid(order[i], a));
+            }
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (hi[a] - lo[a] > hi[axis] - lo[axis])
+                axis = a;
+
+        size_t mid = start + (end - start) / 2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+                         [&](uint32_t a, uint32_t b) { return centroid(a, axis) < centroid(b, axis); });
+        self(self, start, mid);
+        self(self, mid, end);
+    };
+    partition(partition, 0, triangle_count);
+
+    cluster_file_header header = {};
+    std::memcpy(header.magic, cluster_file_header::file_magic, sizeof(header.magic));
+    header.version = cluster_file_header::current_version;
+    header.cluster_count = uint32_t(spans.size());
+    header.table_offset = sizeof(cluster_file_header);
+    header.triangle_count = triangle_count;
+
+    std::vector<cluster_entry> table(spans.size());
+    std::ofstream out(path, std::ios::binary);
+    size_t offset = sizeof(cluster_file_header) + table.size() * sizeof(cluster_entry);
+    out.seekp(std::streamoff(offset));
+
+    std::vector<uint32_t> local_index(mesh.positions.size() / 3, UINT32_MAX);
+    for (size_t c = 0; c < spans.size(); c++) {
+        // Gather the cluster's vertices under local indices.
+        mesh_arrays part;
+        cluster_entry& entry = table[c];
+        for (int a = 0; a < 3; a++) {
+            entry.bounds_min[a] = inf;
+            entry.bounds_max[a] = -inf;
+        }
+
+        for (size_t i = spans[c].first; i < spans[c].second; i++) {
+            for (int corner = 0; corner < 3; corner++) {
+                uint32_t v = mesh.indices[3 * order[i] + corner];
+                if (local_index[v] == UINT32_MAX) {
+                    local_index[v] = uint32_t(part.positions.size() / 3);
+                    for (int a = 0; a < 3; a++) {
+                        float p = mesh.positions[3 * v + a];
+                        part.positions.push_back(p);
+                        entry.bounds_min[a] = std::min(entry.bounds_min[a], p);
+                        entry.bounds_max[a] = std::max(entry.bounds_max[a], p);
+                        if (with_normals)
+                            part.normals.push_back(mesh.normals[3 * v + a]);
+                    }
+                }
+                part.indices.push_back(local_index[v]);
+            }
+        }
+        for (size_t i = spans[c].first; i < spans[c].second; i++)
+            for (int corner = 0; corner < 3; corner++)
+                local_index[mesh.indices[3 * order[i] + corner]] = UINT32_MAX;
+
+        auto image = mesh_file::serialize(part);
+        offset = (offset + page - 1) / page * page;
+        entry.triangle_count = uint32_t(spans[c].second - spans[c].first);
+        entry.offset = offset;
+        entry.size = image.size();
+
+        out.seekp(std::streamoff(offset));
+        out.write(reinterpret_cast<const char*>(image.data()), std::streamsize(image.size()));
+        offset += image.size();
+    }
+
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size() * sizeof(cluster_entry)));
+    return bool(out);
+}
+
+// One cluster in memory: its mesh image, primitives and BVH.
+class resident_cluster {
+  public:
+    resident_cluster(tracked_vector<char> image, const material* mat)
+      : image(std::move(image)), mesh(this->image.data(), this->image.size()),
+        arena(false, size_t(64) << 10) {
+        if (!mesh.valid() || mesh.triangle_count() == 0)
+            return;
+
+        std::vector<bvh_node::item> items;
+        items.reserve(mesh.triangle_count());
+        {
+            memory_scope scope(mem_tag::mesh);
+            for (size_t i = 0; i < mesh.triangle_count(); i++)
+                items.push_back(bvh_node::make_item(arena.make<mesh_triangle>(&mesh, uint32_t(i), mat)));
+        }
+
+        memory_scope scope(mem_tag::bvh);
+        root = arena.make<bvh_node>(items, 0, items.size(), &arena);
+    }
+
+    const hittable* bvh() const { return root.get(); }
+
+    // Bytes the cluster keeps allocated while resident.
+    size_t footprint() const { return mesh.size() + arena.bytes_reserved(); }
+
+  private:
+    tracked_vector<char> image;
+    mesh_file mesh;
+    scene_arena arena;
+    shared_ptr<hittable> root;
+};
+
+// Pages clusters of a cluster file in and out under a memory cap, least recently used first.
+//
+// Clusters are handed out as shared pointers, so a cluster evicted while a thread is still
+// traversing it lives until that thread lets go. A resident cluster is handed out without
+// taking the cache's lock: its slot's pointer is loaded atomically, and the use is only marked
+// on the slot. The lock is taken on misses, which also evict, giving the marked clusters a
+// second chance at the back of the list (an approximation of LRU that hits can keep without
+// reordering the list). A cluster is read once however many threads ask for it at the same
+// time: the first one loads it and the others wait for that load rather than issuing their own.
+class cluster_cache {
+  public:
+    cluster_cache(const std::string& path, const material* mat, size_t capacity_bytes)
+      : path(path), mat(mat), capacity(capacity_bytes) {
+        std::ifstream in(path, std::ios::binary);
+        if (!in.is_open()) {
+            std::cerr << "Error: Could not open file " << path << std::endl;
+            return;
+        }
+
+        cluster_file_header header;
+        in.read(reinterpret_cast<char*>(&header), sizeof(header));
+        if (!in || std::memcmp(header.magic, cluster_file_header::file_magic, sizeof(header.magic)) != 0
+            || header.version != cluster_file_header::current_version) {
+            std::cerr << "Error: " << path << ": not a cluster file" << std::endl;
+            return;
+        }
+
+        in.seekg(0, std::ios::end);
+        uint64_t file_size = uint64_t(in.tellg());
+        uint64_t table_size = uint64_t(header.cluster_count) * sizeof(cluster_entry);
+        if (header.table_offset > file_size || table_size > file_size - header.table_offset) {
+            std::cerr << "Error: " << path << ": truncated cluster table" << std::endl;
+            return;
+        }
+
+        entries.resize(header.cluster_count);
+        in.seekg(std::streamoff(header.table_offset));
+        in.read(reinterpret_cast<char*>(entries.data()), std::streamsize(table_size));
+        if (!in) {
+            std::cerr << "Error: " << path << ": truncated cluster table" << std::endl;
+            entries.clear();
+            return;
+        }
+
+        // Clusters are read into buffers of their recorded size, so the table is checked
+        // against the file before any of it is trusted.
+        for (size_t i = 0; i < entries.size(); i++) {
+            const auto& e = entries[i];
+            if (e.offset > file_size || e.size > file_size - e.offset || e.size < sizeof(mesh_header)) {
+                std::cerr << "Error: " << path << ": cluster " << i << " lies outside the file" << std::endl;
+                entries.clear();
+                return;
+            }
+        }
+
+        slots = std::vector<slot>(entries.size());
+        triangles = size_t(header.triangle_count);
+        ok = true;
+    }
+
+    cluster_cache(const cluster_cache&) = delete;
+    cluster_cache& operator=(const cluster_cache&) = delete;
+
+    bool valid() const { return ok; }
+    size_t cluster_count() const { return entries.size(); }
+    size_t triangle_count() const { return triangles; }
+
+    aabb bounds(size_t cluster) const {
+        const auto& e = entries[cluster];
+        return aabb(point3(e.bounds_min[0], e.bounds_min[1], e.bounds_min[2]),
+                    point3(e.bounds_max[0], e.bounds_max[1], e.bounds_max[2]));
+    }
+
+    // Returns the cluster, reading it first if it is not resident, or null if it could not be
+    // read. A failed read is not cached, so the next request tries again.
+    shared_ptr<const resident_cluster> acquire(size_t cluster) {
+        slot& s = slots[cluster];
+        if (auto data = std::atomic_load(&s.data)) {
+            s.referenced.store(true, std::memory_order_relaxed);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return data;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (s.loading) {
+            waits++;
+            loaded.wait(lock, [&] { return !s.loading; });
+        }
+        if (auto data = std::atomic_load(&s.data)) {
+            s.referenced.store(true, std::memory_order_relaxed);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return data;
+        }
+
+        misses++;
+        s.loading = true;
+        lock.unlock();
+
+        shared_ptr<const resident_cluster> data;
+        try {
+            data = read(cluster);
+        } catch (...) {
+            lock.lock();
+            s.loading = false;
+            loaded.notify_all();
+            throw;
+        }
+
+        lock.lock();
+        s.loading = false;
+        if (data) {
+            std::atomic_store(&s.data, data);
+            s.footprint = data->footprint();
+            resident_bytes += s.footprint;
+            peak_bytes = std::max(peak_bytes, resident_bytes);
+            bytes_read += entries[cluster].size;
+            lru.push_front(cluster);
+            s.position = lru.begin();
+            evict(cluster);
+        } else {
+            failures++;
+        }
+        loaded.notify_all();
+        return data;
+    }
+
+    void report(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t hit_count = hits.load();
+        size_t requests = hit_count + misses;
+        out << "Cache de clusters: " << hit_count << " acertos, " << misses << " leituras ("
+            << (requests ? 100.0 * hits / requests : 0.0) << "% de acerto), " << waits
+            << " esperas por leitura em andamento, " << evictions << " descartes, "
+            << bytes_read / 1024 << " KiB lidos, pico residente "
+            << peak_bytes / 1024 << " KiB de " << capacity / 1024 << " KiB";
+        if (failures > 0)
+            out << ", " << failures << " leituras com erro";
+        out << std::endl;
+    }
+
+  private:
+    struct slot {
+        shared_ptr<const resident_cluster> data;  // Loaded and stored atomically
+        std::atomic<bool> referenced{false};      // Used since eviction last passed it
+        bool loading = false;
+        size_t footprint = 0;
+        std::list<size_t>::iterator position;  // In `lru`, while resident
+    };
+
+    std::string path;
+    const material* mat;
+    size_t capacity;
+    std::vector<cluster_entry> entries;
+    size_t triangles = 0;
+    bool ok = false;
+
+    mutable std::mutex mutex;
+    std::condition_variable loaded;
+    std::vector<slot> slots;
+    std::list<size_t> lru;  // Resident clusters, most recently used first
+    size_t resident_bytes = 0, peak_bytes = 0, bytes_read = 0;
+    std::atomic<size_t> hits{0};
+    size_t misses = 0, waits = 0, evictions = 0, failures = 0;
+
+    shared_ptr<const resident_cluster> read(size_t cluster) const {
+        const auto& e = entries[cluster];
+        tracked_vector<char> image(size_t(e.size), tracking_allocator<char>(mem_tag::mesh));
+
+        std::ifstream in(path, std::ios::binary);
+        in.seekg(std::streamoff(e.offset));
+        in.read(image.data(), std::streamsize(e.size));
+        if (!in) {
+            std::cerr << "Error: " << path << ": could not read cluster " << cluster << std::endl;
+            return nullptr;
+        }
+
+        return make_shared<resident_cluster>(std::move(image), mat);
+    }
+
+    // Drops least recently used clusters until the resident ones fit the cap. Clusters used
+    // since they were last at the back go to the front instead, once per pass over the list;
+    // `loaded_cluster`, just read, always stays.
+    void evict(size_t loaded_cluster) {
+        size_t second_chances = lru.size();
+        while (resident_bytes > capacity && lru.size() > 1) {
+            size_t victim = lru.back();
+            slot& s = slots[victim];
+            bool referenced = s.referenced.exchange(false, std::memory_order_relaxed);
+            if (victim == loaded_cluster || (referenced && second_chances > 0)) {
+                if (victim != loaded_cluster)
+                    second_chances--;
+                lru.splice(lru.begin(), lru, s.position);
+                continue;
+            }
+
+            lru.pop_back();
+            std::atomic_store(&s.data, shared_ptr<const resident_cluster>());
+            resident_bytes -= s.footprint;
+            s.footprint = 0;
+            evictions++;
+        }
+    }
+};
+
+// Stand-in for one cluster in the top-level BVH.
+class cluster_proxy : public hittable {
+  public:
+    cluster_proxy(cluster_cache* cache, size_t index) : cache(cache), index(index) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto cluster = cache->acquire(index);
+        if (!cluster || !cluster->bvh() || !cluster->bvh()->hit(r, ray_t, rec))
+            return false;
+
+        // The cluster may be evicted once it is released, so the surface is evaluated now.
+        rec.complete(r);
+        return true;
+    }
+
+    void bbox(hit_record& rec) const override {
+        rec.bbox_ptr = new aabb(cache->bounds(index));
+    }
+
+  private:
+    cluster_cache* cache;
+    size_t index;
+};
+
+// A mesh rendered out of core: a BVH over the cluster bounds, whose leaves page their cluster
+// in when a ray reaches them.
+class cluster_set : public hittable {
+  public:
+    cluster_set(const std::string& path, const material* mat, size_t capacity_bytes)
+      : cache(path, mat, capacity_bytes) {
+        if (!cache.valid() || cache.cluster_count() == 0)
+            return;
+
+        hittable_list proxies;
+        for (size_t i = 0; i < cache.cluster_count(); i++)
+            proxies.add(make_shared<cluster_proxy>(&cache, i));
+        root = make_shared<bvh_node>(proxies);
+    }
+
+    bool valid() const { return root != nullptr; }
+    size_t triangle_count() const { return cache.triangle_count(); }
+    const cluster_cache& clusters() const { return cache; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return root->hit(r, ray_t, rec);
+    }
+
+    void bbox(hit_record& rec) const override {
+        root->bbox(rec);
+    }
+
+  private:
+    cluster_cache cache;
+    shared_ptr<hittable> root;
+};
+
+#endif
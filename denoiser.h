@@ -0,0 +1,312 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "framebuffer.h"
+#include "memory_ledger.h"
+#include "parallel.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+// What the camera ray of one sample saw first, summed over a pixel's samples: the albedo and
+// shading normal of the first surface it hit (zero if it escaped), the distance to it, the
+// squared luminance of the sample's radiance, from which the denoiser estimates the noise, and
+// whether it hit anything at all. Depth is averaged over the samples that hit, so that a pixel
+// on a silhouette gets the distance of its surface rather than a blend with the sky's zero.
+struct feature_sample {
+    color  albedo = color(0,0,0);
+    vec3   normal = vec3(0,0,0);
+    double depth = 0;
+    double luminance_squared = 0;
+    double hits = 0;
+
+    void add(const feature_sample& s) {
+        albedo += s.albedo;
+        normal += s.normal;
+        depth += s.depth;
+        luminance_squared += s.luminance_squared;
+        hits += s.hits;
+    }
+};
+
+// Per-pixel sums of feature samples, alongside a framebuffer that holds the sample counts.
+// Tiles cover disjoint pixels, so render threads add to it without locking.
+class feature_buffer {
+  public:
+    static constexpr int channels = 9;  // albedo rgb, normal xyz, depth, luminance squared, hits
+
+    feature_buffer(int width, int height)
+      : image_width(width), image_height(height),
+        data(size_t(width) * height * channels, 0.0f, tracking_allocator<float>(mem_tag::framebuffer)) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    void clear() { std::fill(data.begin(), data.end(), 0.0f); }
+
+    void add(int x, int y, const feature_sample& sum) {
+        float* px = &data[(size_t(y) * image_width + x) * channels];
+        for (int k = 0; k < 3; k++) {
+            px[k] += float(sum.albedo[k]);
+            px[3 + k] += float(sum.normal[k]);
+        }
+        px[6] += float(sum.depth);
+        px[7] += float(sum.luminance_squared);
+        px[8] += float(sum.hits);
+    }
+
+    // Mean features of pixel (x, y) over its `samples` samples; the depth is the mean over the
+    // samples that hit, and 0 if none did.
+    feature_sample mean(int x, int y, double samples) const {
+        feature_sample f;
+        if (samples <= 0)
+            return f;
+        const float* px = &data[(size_t(y) * image_width + x) * channels];
+        double scale = 1.0 / samples;
+        f.albedo = color(px[0], px[1], px[2]) * scale;
+        f.normal = vec3(px[3], px[4], px[5]) * scale;
+        f.depth = px[8] > 0 ? px[6] / px[8] : 0;
+        f.luminance_squared = px[7] * scale;
+        f.hits = px[8];
+        return f;
+    }
+
+    // Writes the albedo, normal and depth buffers as `<prefix>_albedo.pfm`, `_normal.pfm` and
+    // `_depth.pfm` (linear floats, as external denoisers expect them).
+    bool write(const std::string& prefix, const framebuffer& image) const {
+        std::vector<float> albedo, normal, depth;
+        albedo.reserve(size_t(image_width) * image_height * 3);
+        normal.reserve(albedo.capacity());
+        depth.reserve(size_t(image_width) * image_height);
+        for (int y = 0; y < image_height; y++) {
+            for (int x = 0; x < image_width; x++) {
+                auto f = mean(x, y, image.samples(x, y));
+                vec3 n = f.normal.near_zero() ? f.normal : unit_vector(f.normal);
+                for (int k = 0; k < 3; k++) {
+                    albedo.push_back(float(f.albedo[k]));
+                    normal.push_back(float(n[k]));
+                }
+                depth.push_back(float(f.depth));
+            }
+        }
+        return write_pfm(prefix + "_albedo.pfm", albedo, 3)
+            && write_pfm(prefix + "_normal.pfm", normal, 3)
+            && write_pfm(prefix + "_depth.pfm", depth, 1);
+    }
+
+  private:
+    int image_width, image_height;
+    tracked_vector<float> data;
+
+    bool write_pfm(const std::string& path, const std::vector<float>& pixels, int components) const {
+        std::ofstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << path << std::endl;
+            return false;
+        }
+
+        const uint16_t probe = 1;
+        bool little_endian = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+        file << (components == 3 ? "PF" : "Pf") << "\n" << image_width << " " << image_height
+             << "\n" << (little_endian ? "-1.0" : "1.0") << "\n";
+
+        // PFM rows run from the bottom of the image up.
+        size_t row_floats = size_t(image_width) * components;
+        for (int y = image_height - 1; y >= 0; y--)
+            file.write(reinterpret_cast<const char*>(&pixels[size_t(y) * row_floats]),
+                       std::streamsize(row_floats * sizeof(float)));
+        return bool(file);
+    }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with the luminance edge-stopping
+// function scaled by each pixel's estimated noise as in SVGF (Schied et al. 2017), for a
+// single frame.
+//
+// The image is divided by the first-hit albedo before filtering and multiplied back after, so
+// only the lighting is smoothed and material edges stay sharp. Each pass widens a 5x5 B3-spline
+// kernel by leaving holes between its taps (steps of 1, 2, 4, ... pixels), weighting every
+// tap by how alike its normal, depth and luminance are to the center pixel's. Pixels whose
+// camera rays escaped are left alone.
+class denoiser {
+  public:
+    int    iterations = 5;            // Passes; the kernel reaches 2^(iterations+1) pixels
+    double sigma_luminance = 4.0;     // Luminance tolerance, in standard deviations of the noise
+    double sigma_normal = 128.0;      // Exponent on the cosine between normals
+    double sigma_depth = 1.0;         // Depth tolerance, in local depth gradients
+
+    // Filters `image` in place, on `threads` threads (0 for all).
+    void apply(framebuffer& image, const feature_buffer& features, int threads = 0) const {
+        const int w = image.width(), h = image.height();
+        const size_t n = size_t(w) * h;
+
+        pixel_guide guide(n);
+        tracked_vector<float> current(n * 4, 0.0f, tracking_allocator<float>(mem_tag::framebuffer));
+        tracked_vector<float> next(n * 4, 0.0f, tracking_allocator<float>(mem_tag::framebuffer));
+
+        // Demodulate, and estimate the variance of each pixel's mean from its sample moments.
+        parallel_for(size_t(h), threads, [&](size_t y) {
+            for (int x = 0; x < w; x++) {
+                size_t i = y * w + x;
+                double samples = image.samples(x, int(y));
+                auto f = features.mean(x, int(y), samples);
+                color c = image.average(x, int(y));
+
+                color factor(1, 1, 1);
+                for (int k = 0; k < 3; k++)
+                    if (f.albedo[k] > 0.01)
+                        factor[k] = f.albedo[k];
+
+                double lum = luminance(c);
+                double variance = samples > 0 ? std::fmax(0.0, f.luminance_squared - lum * lum) / samples : 0;
+                double scale = std::fmax(0.01, luminance(factor));
+
+                for (int k = 0; k < 3; k++) {
+                    guide.albedo[i * 3 + k] = float(factor[k]);
+                    current[i * 4 + k] = float(c[k] / factor[k]);
+                }
+                current[i * 4 + 3] = float(variance / (scale * scale));
+
+                vec3 normal = f.normal.near_zero() ? vec3(0,0,0) : unit_vector(f.normal);
+                for (int k = 0; k < 3; k++)
+                    guide.normal[i * 3 + k] = float(normal[k]);
+                guide.depth[i] = float(f.depth);
+            }
+        });
+
+        // Depth gradient: the smaller one-sided difference along each axis, so silhouettes do
+        // not count as slopes.
+        parallel_for(size_t(h), threads, [&](size_t y) {
+            for (int x = 0; x < w; x++) {
+                size_t i = y * w + x;
+                guide.gradient[i] = float(std::fmax(slope(guide, w, h, x, int(y), 1, 0),
+                                                    slope(guide, w, h, x, int(y), 0, 1)));
+            }
+        });
+
+        for (int pass = 0; pass < iterations; pass++) {
+            int step = 1 << pass;
+            parallel_for(size_t(h), threads, [&](size_t y) {
+                for (int x = 0; x < w; x++)
+                    filter_pixel(guide, current, next, w, h, x, int(y), step);
+            });
+            std::swap(current, next);
+        }
+
+        parallel_for(size_t(h), threads, [&](size_t y) {
+            for (int x = 0; x < w; x++) {
+                size_t i = y * w + x;
+                if (guide.depth[i] <= 0)
+                    continue;
+                image.set_average(x, int(y), color(current[i * 4 + 0] * guide.albedo[i * 3 + 0],
+                                                   current[i * 4 + 1] * guide.albedo[i * 3 + 1],
+                                                   current[i * 4 + 2] * guide.albedo[i * 3 + 2]));
+            }
+        });
+    }
+
+  private:
+    struct pixel_guide {
+        tracked_vector<float> albedo, normal, depth, gradient;
+
+        explicit pixel_guide(size_t n)
+          : albedo(n * 3, 0.0f, tracking_allocator<float>(mem_tag::framebuffer)),
+            normal(n * 3, 0.0f, tracking_allocator<float>(mem_tag::framebuffer)),
+            depth(n, 0.0f, tracking_allocator<float>(mem_tag::framebuffer)),
+            gradient(n, 0.0f, tracking_allocator<float>(mem_tag::framebuffer)) {}
+    };
+
+    static double slope(const pixel_guide& guide, int w, int h, int x, int y, int dx, int dy) {
+        double z = guide.depth[size_t(y) * w + x];
+        double best = infinity;
+        for (int side : {-1, 1}) {
+            int qx = x + side * dx, qy = y + side * dy;
+            if (qx < 0 || qy < 0 || qx >= w || qy >= h)
+                continue;
+            double zq = guide.depth[size_t(qy) * w + qx];
+            if (zq > 0)
+                best = std::fmin(best, std::fabs(zq - z));
+        }
+        return best == infinity ? 0 : best;
+    }
+
+    void filter_pixel(const pixel_guide& guide, const tracked_vector<float>& in, tracked_vector<float>& out,
+                      int w, int h, int x, int y, int step) const {
+        static const double kernel[5] = {1.0 / 16, 1.0 / 4, 3.0 / 8, 1.0 / 4, 1.0 / 16};
+
+        size_t p = size_t(y) * w + x;
+        if (guide.depth[p] <= 0) {
+            std::memcpy(&out[p * 4], &in[p * 4], 4 * sizeof(float));
+            return;
+        }
+
+        // Noise level at p, from the variance blurred over its 3x3 neighbourhood.
+        double variance = 0, variance_weight = 0;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int qx = x + dx, qy = y + dy;
+                if (qx < 0 || qy < 0 || qx >= w || qy >= h)
+                    continue;
+                double k = (dx == 0 ? 0.5 : 0.25) * (dy == 0 ? 0.5 : 0.25);
+                variance += k * in[(size_t(qy) * w + qx) * 4 + 3];
+                variance_weight += k;
+            }
+        }
+        double inverse_luminance_scale = 1 / (sigma_luminance * std::sqrt(std::fmax(0.0, variance / variance_weight)) + 1e-6);
+
+        const float* cp = &in[p * 4];
+        double lp = luminance(color(cp[0], cp[1], cp[2]));
+        vec3 np(guide.normal[p * 3], guide.normal[p * 3 + 1], guide.normal[p * 3 + 2]);
+        double zp = guide.depth[p];
+        double inverse_depth_scale = 1 / (sigma_depth * guide.gradient[p] * step + 1e-6);
+
+        color sum(0, 0, 0);
+        double sum_variance = 0, sum_weight = 0;
+        for (int ky = -2; ky <= 2; ky++) {
+            int qy = y + ky * step;
+            if (qy < 0 || qy >= h)
+                continue;
+            for (int kx = -2; kx <= 2; kx++) {
+                int qx = x + kx * step;
+                if (qx < 0 || qx >= w)
+                    continue;
+
+                size_t q = size_t(qy) * w + qx;
+                double zq = guide.depth[q];
+                if (zq <= 0)
+                    continue;
+
+                const float* cq = &in[q * 4];
+                vec3 nq(guide.normal[q * 3], guide.normal[q * 3 + 1], guide.normal[q * 3 + 2]);
+
+                double weight = kernel[kx + 2] * kernel[ky + 2];
+                if (q != p) {
+                    // The three edge-stopping terms multiply, so their logarithms add up to a
+                    // single exponential; taps that far apart are skipped without evaluating it.
+                    double cosine = dot(np, nq);
+                    if (cosine <= 0)
+                        continue;
+                    double exponent = sigma_normal * std::log(cosine)
+                                    - std::fabs(zp - zq) * inverse_depth_scale / (std::abs(kx) + std::abs(ky))
+                                    - std::fabs(lp - luminance(color(cq[0], cq[1], cq[2]))) * inverse_luminance_scale;
+                    if (exponent < -20)
+                        continue;
+                    weight *= std::exp(exponent);
+                }
+
+                sum += weight * color(cq[0], cq[1], cq[2]);
+                sum_variance += weight * weight * cq[3];
+                sum_weight += weight;
+            }
+        }
+
+        float* o = &out[p * 4];
+        for (int k = 0; k < 3; k++)
+            o[k] = float(sum[k] / sum_weight);
+        o[3] = float(sum_variance / (sum_weight * sum_weight));
+    }
+};
+
+#endif
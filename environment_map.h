@@ -0,0 +1,182 @@
+#ifndef ENVIRONMENT_MAP_H
+#define ENVIRONMENT_MAP_H
+
+#include "rtweekend.h"
+#include "memory_ledger.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Light arriving from infinitely far away, stored as an equirectangular HDR image: u runs
+// around the vertical (+y) axis and v from straight up (top row) to straight down.
+//
+// Directions are importance sampled in proportion to the luminance of each texel times the
+// solid angle it covers, through a 2D CDF: a marginal one picks the row and the row's own
+// conditional one picks the column. A small bright sun then gets most of the samples.
+class environment_map {
+  public:
+    // Loads a PFM image (color "PF" or grayscale "Pf"), scaling its radiance by `intensity`.
+    explicit environment_map(const std::string& path, double intensity = 1.0)
+      : intensity(intensity) {
+        if (!load_pfm(path))
+            return;
+        build_distribution();
+    }
+
+    environment_map(const environment_map&) = delete;
+    environment_map& operator=(const environment_map&) = delete;
+
+    bool valid() const { return total > 0; }
+    int image_width() const { return width; }
+    int image_height() const { return height; }
+
+    // Radiance arriving along -direction (that is, seen looking towards `direction`).
+    color radiance(const vec3& direction) const {
+        int x, y;
+        texel(direction, x, y);
+        const float* p = &pixels[3 * (size_t(y) * width + x)];
+        return intensity * color(p[0], p[1], p[2]);
+    }
+
+    // A random direction, distributed as pdf_value() describes. One 2D sample picks the
+    // texel, and where it falls inside the texel's span of each CDF places the direction
+    // within the texel, so strata of the sample carry over to the sphere.
+    vec3 random() const {
+        auto s = sample_2d();
+
+        auto row_end = marginal.begin() + 1 + height;
+        double target_y = s.u * total;
+        int y = int(std::upper_bound(marginal.begin() + 1, row_end, target_y) - marginal.begin()) - 1;
+        y = std::clamp(y, 0, height - 1);
+
+        const double* row = &conditional[size_t(y) * (width + 1)];
+        double target_x = s.v * row[width];
+        int x = int(std::upper_bound(row + 1, row + 1 + width, target_x) - row) - 1;
+        x = std::clamp(x, 0, width - 1);
+
+        double u = (x + fraction_within(target_x, row[x], row[x + 1])) / width;
+        double v = (y + fraction_within(target_y, marginal[y], marginal[y + 1])) / height;
+        return direction_at(u, v);
+    }
+
+    // Solid-angle density with which random() returns `direction`.
+    double pdf_value(const vec3& direction) const {
+        int x, y;
+        texel(direction, x, y);
+        double weight = conditional[size_t(y) * (width + 1) + x + 1] - conditional[size_t(y) * (width + 1) + x];
+
+        double sin_theta = std::sqrt(std::fmax(0.0, 1.0 - unit_vector(direction).y() * unit_vector(direction).y()));
+        if (sin_theta <= 0)
+            return 0;
+
+        // Density over the (u, v) square, divided by the Jacobian of the spherical mapping.
+        double pdf_uv = weight / total * width * height;
+        return pdf_uv / (2 * pi * pi * sin_theta);
+    }
+
+  private:
+    int width = 0, height = 0;
+    double intensity;
+    tracked_vector<float> pixels{tracking_allocator<float>(mem_tag::materials)};
+    tracked_vector<double> marginal{tracking_allocator<double>(mem_tag::materials)};     // height + 1 prefix sums
+    tracked_vector<double> conditional{tracking_allocator<double>(mem_tag::materials)};  // (width + 1) per row
+    double total = 0;
+
+    static vec3 direction_at(double u, double v) {
+        double phi = 2 * pi * u;
+        double theta = pi * v;
+        return vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    }
+
+    // Position of `target` within [low, high), in [0, 1).
+    static double fraction_within(double target, double low, double high) {
+        if (high <= low)
+            return 0.5;
+        return std::clamp((target - low) / (high - low), 0.0, 0.999999);
+    }
+
+    void texel(const vec3& direction, int& x, int& y) const {
+        vec3 d = unit_vector(direction);
+        double theta = std::acos(std::clamp(d.y(), -1.0, 1.0));
+        double phi = std::atan2(d.z(), d.x());
+        if (phi < 0)
+            phi += 2 * pi;
+
+        x = std::clamp(int(phi / (2 * pi) * width), 0, width - 1);
+        y = std::clamp(int(theta / pi * height), 0, height - 1);
+    }
+
+    void build_distribution() {
+        marginal.assign(size_t(height) + 1, 0.0);
+        conditional.assign(size_t(height) * (width + 1), 0.0);
+
+        for (int y = 0; y < height; y++) {
+            double sin_theta = std::sin(pi * (y + 0.5) / height);
+            double* row = &conditional[size_t(y) * (width + 1)];
+            for (int x = 0; x < width; x++) {
+                const float* p = &pixels[3 * (size_t(y) * width + x)];
+                double luminance = 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+                row[x + 1] = row[x] + std::fmax(0.0, luminance) * sin_theta;
+            }
+            marginal[y + 1] = marginal[y] + row[width];
+        }
+        total = marginal[height];
+    }
+
+    bool load_pfm(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << path << std::endl;
+            return false;
+        }
+
+        std::string type;
+        double scale = 0;
+        file >> type >> width >> height >> scale;
+        file.get();  // Single whitespace character before the raster
+        int channels = type == "PF" ? 3 : (type == "Pf" ? 1 : 0);
+        if (!file || channels == 0 || width <= 0 || height <= 0 || scale == 0) {
+            std::cerr << "Error: " << path << ": not a PFM image" << std::endl;
+            width = height = 0;
+            return false;
+        }
+
+        std::vector<float> raster(size_t(width) * height * channels);
+        file.read(reinterpret_cast<char*>(raster.data()), std::streamsize(raster.size() * sizeof(float)));
+        if (!file) {
+            std::cerr << "Error: " << path << ": truncated PFM image" << std::endl;
+            width = height = 0;
+            return false;
+        }
+
+        // A negative scale marks little-endian data.
+        const uint16_t probe = 1;
+        bool little_endian_host = *reinterpret_cast<const unsigned char*>(&probe) == 1;
+        if ((scale < 0) != little_endian_host) {
+            for (auto& value : raster) {
+                uint32_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+                std::memcpy(&value, &bits, sizeof(bits));
+            }
+        }
+
+        // PFM rows run from the bottom of the image up.
+        pixels.resize(size_t(width) * height * 3);
+        for (int y = 0; y < height; y++) {
+            const float* src = &raster[size_t(height - 1 - y) * width * channels];
+            float* dst = &pixels[size_t(y) * width * 3];
+            for (int x = 0; x < width; x++)
+                for (int k = 0; k < 3; k++)
+                    dst[3 * x + k] = src[x * channels + (channels == 3 ? k : 0)];
+        }
+        return true;
+    }
+};
+
+#endif
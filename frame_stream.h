@@ -0,0 +1,308 @@
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include "framebuffer.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Raw frame output for pipelines (encoders, image-diff tools), written tile by tile as the
+// render finishes them, so consumers can start before the frame is done.
+//
+// Every frame starts with a frame_header. On a stream (stdout, a file or a named pipe) it is
+// followed by one frame_tile record plus its pixels, row by row, per tile, in the order the
+// tiles finish. A memory-mapped file instead holds the header followed by the whole image, row
+// by row; tiles are written in place and `tiles_done` counts those that have landed. Pixels are
+// RGB, in native byte order: 8 or 16 bits per channel, or linear floats.
+
+enum class frame_format : uint32_t { rgb8 = 1, rgb16 = 2, rgb_float = 3 };
+
+struct frame_header {
+    static constexpr char file_magic[8] = {'R', 'T', 'F', 'R', 'A', 'M', 'E', '\0'};
+    static constexpr uint32_t current_version = 1;
+    enum : uint32_t { tile_packets = 0, whole_image = 1 };
+
+    char magic[8];
+    uint32_t version;
+    uint32_t format;      // frame_format
+    uint32_t width;
+    uint32_t height;
+    uint32_t tile_size;
+    uint32_t tile_count;
+    uint32_t frame;       // Frame number, from 0
+    uint32_t layout;      // tile_packets or whole_image
+    uint64_t tiles_done;  // whole_image: tiles written so far
+    uint64_t reserved[2];
+};
+
+struct frame_tile {
+    uint32_t x0, y0, width, height;
+};
+
+static_assert(sizeof(frame_header) == 64 && sizeof(frame_tile) == 16,
+              "frame records must keep their layout");
+
+class frame_stream {
+  public:
+    // `target` is "-" for stdout, otherwise a path (a regular file or a named pipe). With
+    // `mapped`, the path is a file preallocated to one frame and mapped into memory.
+    frame_stream(const std::string& target, frame_format format, bool mapped = false)
+      : format(format), mapped(mapped), path(target) {
+#if defined(_WIN32)
+        if (mapped) {
+            std::cerr << "Error: memory-mapped frame output is not supported on this platform" << std::endl;
+            return;
+        }
+        if (target == "-") {
+            // Each stream writes to its own copy of stdout, in binary mode: in text mode every
+            // 0x0A byte of the pixels would turn into CR LF.
+            int out = _dup(stdout_fd >= 0 ? stdout_fd : _fileno(stdout));
+            if (out >= 0) {
+                _setmode(out, _O_BINARY);
+                stream = _fdopen(out, "wb");
+                if (!stream)
+                    _close(out);
+            }
+        } else {
+            stream = std::fopen(target.c_str(), "wb");
+        }
+#else
+        if (mapped) {
+            fd = open(target.c_str(), O_RDWR | O_CREAT, 0644);
+        } else {
+            signal(SIGPIPE, SIG_IGN);  // A consumer that quits shows up as a write error instead
+            fd = target == "-" ? (stdout_fd >= 0 ? stdout_fd : STDOUT_FILENO)
+                               : open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+#endif
+        if (!is_open())
+            std::cerr << "Error: Could not open " << target << " for frame output" << std::endl;
+    }
+
+    ~frame_stream() {
+#if defined(_WIN32)
+        if (stream)
+            std::fclose(stream);
+#else
+        unmap();
+        if (fd >= 0 && fd != STDOUT_FILENO && fd != stdout_fd)
+            close(fd);
+#endif
+    }
+
+    frame_stream(const frame_stream&) = delete;
+    frame_stream& operator=(const frame_stream&) = delete;
+
+    bool is_open() const {
+#if defined(_WIN32)
+        return stream != nullptr;
+#else
+        return fd >= 0;
+#endif
+    }
+
+    bool failed() const { return error; }
+
+    static size_t pixel_bytes(frame_format format) {
+        switch (format) {
+            case frame_format::rgb8: return 3;
+            case frame_format::rgb16: return 3 * sizeof(uint16_t);
+            default: return 3 * sizeof(float);
+        }
+    }
+
+    // Keeps stdout for frames only: frame streams to "-" write to a private copy of it, and
+    // everything else the program prints on stdout goes to stderr. Call before printing.
+    static void claim_stdout() {
+        std::fflush(stdout);
+#if defined(_WIN32)
+        stdout_fd = _dup(_fileno(stdout));
+        _dup2(_fileno(stderr), _fileno(stdout));
+#else
+        stdout_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+#endif
+    }
+
+    void begin_frame(int width, int height, int tile_size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!is_open() || error)
+            return;
+
+        frame_header h = {};
+        std::memcpy(h.magic, frame_header::file_magic, sizeof(h.magic));
+        h.version = frame_header::current_version;
+        h.format = uint32_t(format);
+        h.width = uint32_t(width);
+        h.height = uint32_t(height);
+        h.tile_size = uint32_t(tile_size);
+        h.tile_count = uint32_t(((width + tile_size - 1) / tile_size) * ((height + tile_size - 1) / tile_size));
+        h.frame = frame_number;
+        h.layout = mapped ? frame_header::whole_image : frame_header::tile_packets;
+        frame_width = width;
+
+        if (mapped) {
+            if (!map(sizeof(frame_header) + size_t(width) * height * pixel_bytes(format)))
+                return;
+            std::memcpy(view, &h, sizeof(h));
+        } else {
+            write_all(&h, sizeof(h));
+        }
+    }
+
+    // Writes the tile with corner (x0, y0) from the averages in `image`. Tiles may be added
+    // from several threads at once.
+    void add_tile(const framebuffer& image, int x0, int y0, int w, int h) {
+        if (!is_open() || error)
+            return;
+
+        size_t row_bytes = size_t(w) * pixel_bytes(format);
+        if (mapped) {
+            // Tiles cover disjoint pixels, so they are converted straight into the mapping.
+            unsigned char* pixels = view + sizeof(frame_header);
+            for (int y = y0; y < y0 + h; y++)
+                convert(image, x0, y, w, pixels + (size_t(y) * frame_width + x0) * pixel_bytes(format));
+
+            std::lock_guard<std::mutex> lock(mutex);
+            std::atomic_thread_fence(std::memory_order_release);
+            reinterpret_cast<frame_header*>(view)->tiles_done++;
+            return;
+        }
+
+        thread_local std::vector<unsigned char> packet;
+        packet.resize(sizeof(frame_tile) + row_bytes * h);
+        frame_tile tile = {uint32_t(x0), uint32_t(y0), uint32_t(w), uint32_t(h)};
+        std::memcpy(packet.data(), &tile, sizeof(tile));
+        for (int y = 0; y < h; y++)
+            convert(image, x0, y0 + y, w, packet.data() + sizeof(frame_tile) + y * row_bytes);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        write_all(packet.data(), packet.size());
+    }
+
+    // Flushes the frame. Returns false if any write failed.
+    bool end_frame() {
+        std::lock_guard<std::mutex> lock(mutex);
+        frame_number++;
+#if defined(_WIN32)
+        if (stream)
+            std::fflush(stream);
+#else
+        if (view)
+            msync(view, view_bytes, MS_ASYNC);
+#endif
+        return is_open() && !error;
+    }
+
+  private:
+    frame_format format;
+    bool mapped;
+    std::string path;
+    std::mutex mutex;
+    uint32_t frame_number = 0;
+    int frame_width = 0;
+    std::atomic<bool> error{false};
+    unsigned char* view = nullptr;  // Mapped file
+    size_t view_bytes = 0;
+#if defined(_WIN32)
+    std::FILE* stream = nullptr;
+#else
+    int fd = -1;
+#endif
+    static inline int stdout_fd = -1;  // Set by claim_stdout
+
+    void convert(const framebuffer& image, int x0, int y, int w, unsigned char* out) const {
+        static const interval intensity8(0.000, 0.999);
+        static const interval intensity16(0.000, 0.99999);
+        for (int x = x0; x < x0 + w; x++) {
+            color c = image.average(x, y);
+            for (int k = 0; k < 3; k++) {
+                if (format == frame_format::rgb8) {
+                    *out++ = static_cast<unsigned char>(256 * intensity8.clamp(c[k]));
+                } else if (format == frame_format::rgb16) {
+                    auto value = static_cast<uint16_t>(65536 * intensity16.clamp(c[k]));
+                    std::memcpy(out, &value, sizeof(value));
+                    out += sizeof(value);
+                } else {
+                    auto value = static_cast<float>(c[k]);
+                    std::memcpy(out, &value, sizeof(value));
+                    out += sizeof(value);
+                }
+            }
+        }
+    }
+
+    void write_all(const void* data, size_t bytes) {
+#if defined(_WIN32)
+        if (std::fwrite(data, 1, bytes, stream) != bytes)
+            fail();
+#else
+        const auto* p = static_cast<const unsigned char*>(data);
+        while (bytes > 0) {
+            ssize_t written = write(fd, p, bytes);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                fail();
+                return;
+            }
+            p += written;
+            bytes -= size_t(written);
+        }
+#endif
+    }
+
+    void fail() {
+        if (!error)
+            std::cerr << "Error: frame output to " << path << " failed" << std::endl;
+        error = true;
+    }
+
+#if !defined(_WIN32)
+    bool map(size_t bytes) {
+        if (view && view_bytes == bytes)
+            return true;
+        unmap();
+        if (ftruncate(fd, off_t(bytes)) != 0) {
+            fail();
+            return false;
+        }
+        void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED) {
+            fail();
+            return false;
+        }
+        view = static_cast<unsigned char*>(memory);
+        view_bytes = bytes;
+        return true;
+    }
+
+    void unmap() {
+        if (view)
+            munmap(view, view_bytes);
+        view = nullptr;
+        view_bytes = 0;
+    }
+#else
+    bool map(size_t) { return false; }
+#endif
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "rtweekend.h"
+#include "memory_ledger.h"
+
+#include <vector>
+
+// Linear HDR accumulation buffer for a whole image, written tile by tile.
+//
+// Each pixel holds the running sum of its sample radiance plus its sample count (4 floats, 16
+// bytes). Rows are padded to whole cache lines and tiles start on multiples of `tile_size`
+// pixels (512 bytes), so two threads merging different tiles never write the same cache line.
+// Accumulating sums instead of final colors means more passes can be added at any time;
+// tonemapping and quantization are a separate pass at the end.
+class framebuffer {
+  public:
+    static constexpr int tile_size = 32;
+    static constexpr int channels = 4;  // r, g, b, sample count
+
+    framebuffer(int width, int height)
+      : image_width(width), image_height(height),
+        stride(((width * channels + floats_per_line - 1) / floats_per_line) * floats_per_line),
+        lines(size_t(stride / floats_per_line) * size_t(height), cache_line{},
+              tracking_allocator<cache_line>(mem_tag::framebuffer)) {}
+
+    int width() const { return image_width; }
+    int height() const { return image_height; }
+
+    int tiles_x() const { return (image_width + tile_size - 1) / tile_size; }
+    int tiles_y() const { return (image_height + tile_size - 1) / tile_size; }
+    int tile_count() const { return tiles_x() * tiles_y(); }
+
+    void clear() {
+        std::fill(lines.begin(), lines.end(), cache_line{});
+    }
+
+    // Thread-private accumulator for one tile. Threads render into their own tile_buffer and
+    // merge it when the tile is done, so the shared buffer sees one write burst per tile.
+    class alignas(64) tile_buffer {
+      public:
+        int x0 = 0, y0 = 0, w = 0, h = 0;
+
+        tile_buffer() { memory_ledger::charge(mem_tag::framebuffer, sizeof(tile_buffer)); }
+        ~tile_buffer() { memory_ledger::release(mem_tag::framebuffer, sizeof(tile_buffer)); }
+
+        tile_buffer(const tile_buffer&) = delete;
+        tile_buffer& operator=(const tile_buffer&) = delete;
+
+        void reset(const framebuffer& fb, int tile) {
+            x0 = (tile % fb.tiles_x()) * tile_size;
+            y0 = (tile / fb.tiles_x()) * tile_size;
+            w = std::min(tile_size, fb.width() - x0);
+            h = std::min(tile_size, fb.height() - y0);
+            std::fill(std::begin(data), std::end(data), 0.0f);
+        }
+
+        // Adds `samples` samples whose radiance sums to `sum` at image pixel (x, y).
+        void add(int x, int y, const color& sum, int samples) {
+            float* px = &data[((y - y0) * tile_size + (x - x0)) * channels];
+            px[0] += float(sum.x());
+            px[1] += float(sum.y());
+            px[2] += float(sum.z());
+            px[3] += float(samples);
+        }
+
+      private:
+        friend class framebuffer;
+        float data[tile_size * tile_size * channels];
+    };
+
+    void merge(const tile_buffer& tile) {
+        for (int y = 0; y < tile.h; y++) {
+            float* dst = row(tile.y0 + y) + tile.x0 * channels;
+            const float* src = &tile.data[y * tile_size * channels];
+            for (int i = 0; i < tile.w * channels; i++)
+                dst[i] += src[i];
+        }
+    }
+
+    // Mean radiance of pixel (x, y), in linear HDR.
+    color average(int x, int y) const {
+        const float* px = row(y) + x * channels;
+        if (px[3] <= 0)
+            return color(0,0,0);
+        double scale = 1.0 / px[3];
+        return color(px[0] * scale, px[1] * scale, px[2] * scale);
+    }
+
+    // Sample count of pixel (x, y).
+    float samples(int x, int y) const {
+        return row(y)[x * channels + 3];
+    }
+
+    // Replaces the mean of pixel (x, y), keeping its sample count.
+    void set_average(int x, int y, const color& c) {
+        float* px = row(y) + x * channels;
+        for (int k = 0; k < 3; k++)
+            px[k] = float(c[k] * px[3]);
+    }
+
+    // Tonemap and quantize to 8-bit RGB, top row first. With `gamma` false the linear values are
+    // clamped straight to [0,1], as the renderer has always done.
+    std::vector<unsigned char> to_rgb8(bool gamma = false) const {
+        std::vector<unsigned char> out(size_t(image_width) * image_height * 3);
+        to_rgb8(0, image_height, out.data(), gamma);
+        return out;
+    }
+
+    // Same, for rows [y_begin, y_end) into `out` (3 bytes per pixel, tightly packed).
+    void to_rgb8(int y_begin, int y_end, unsigned char* out, bool gamma = false) const {
+        static const interval intensity(0.000, 0.999);
+        for (int y = y_begin; y < y_end; y++) {
+            for (int x = 0; x < image_width; x++) {
+                color c = average(x, y);
+                for (int k = 0; k < 3; k++) {
+                    double value = gamma ? linear_to_gamma(c[k]) : c[k];
+                    *out++ = static_cast<unsigned char>(256 * intensity.clamp(value));
+                }
+            }
+        }
+    }
+
+  private:
+    static constexpr int floats_per_line = 16;
+
+    struct alignas(64) cache_line {
+        float v[floats_per_line] = {};
+    };
+
+    int image_width, image_height;
+    int stride;  // Floats per row, a whole number of cache lines
+    tracked_vector<cache_line> lines;
+
+    float* row(int y) { return lines[0].v + size_t(y) * stride; }
+    const float* row(int y) const { return lines[0].v + size_t(y) * stride; }
+};
+
+#endif
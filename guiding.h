@@ -0,0 +1,200 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "aabb.h"
+#include "memory_ledger.h"
+#include "parallel.h"
+#include "sampler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Path guiding: a learned estimate of where the light arriving at each region of the scene
+// comes from, so bounces can be aimed there instead of only where the material scatters
+// (after Mueller et al. 2017, "Practical Path Guiding").
+//
+// Space is divided by an octree. Each leaf holds a histogram of incident radiance over
+// directions, 16x16 bins on an equal-area (cos theta, phi) map of the sphere. Rendering runs
+// in passes of growing sample counts: during a pass, paths add their radiance estimates to the
+// leaves they cross, and between passes each leaf's histogram becomes the distribution that
+// the next pass samples from, and leaves that received many samples split in eight.
+class path_guide {
+  public:
+    static constexpr int phi_bins = 16;
+    static constexpr int cos_bins = 16;
+    static constexpr int bins = phi_bins * cos_bins;
+
+    // A leaf of the octree.
+    class region {
+      public:
+        // Whether a previous pass has trained this region.
+        bool trained() const { return !cdf.empty(); }
+
+      private:
+        friend class path_guide;
+
+        tracked_vector<float> cdf{tracking_allocator<float>(mem_tag::other)};  // bins + 1 prefix sums
+        std::unique_ptr<std::atomic<float>[]> records{new std::atomic<float>[bins]()};
+        std::atomic<uint32_t> samples{0};
+    };
+
+    // Guides the space inside `bounds`; points outside fall in the nearest region.
+    explicit path_guide(const aabb& bounds, uint32_t split_samples = 4000)
+      : split_samples(split_samples) {
+        point3 low(bounds.x.min, bounds.y.min, bounds.z.min);
+        point3 high(bounds.x.max, bounds.y.max, bounds.z.max);
+        vec3 size = high - low;
+        double half = 0.5 * std::fmax(size.x(), std::fmax(size.y(), size.z())) * 1.001;
+        nodes.push_back({0.5 * (low + high), half, -1, make_region()});
+    }
+
+    path_guide(const path_guide&) = delete;
+    path_guide& operator=(const path_guide&) = delete;
+
+    ~path_guide() {
+        memory_ledger::release(mem_tag::other, regions.size() * region_bytes);
+    }
+
+    size_t region_count() const { return regions.size(); }
+
+    region& find(const point3& p) const {
+        const node* n = &nodes[0];
+        while (n->children >= 0)
+            n = &nodes[n->children + octant(*n, p)];
+        return *regions[n->region];
+    }
+
+    // A direction drawn from a trained region's distribution, from one 2D sample: the first
+    // coordinate picks the bin and its position inside the bin's span of the CDF picks cos
+    // theta within the bin, the second picks phi.
+    vec3 sample(const region& r, sample2 s) const {
+        const float* cdf = r.cdf.data();
+        double target = s.u * cdf[bins];
+        int bin = int(std::upper_bound(cdf + 1, cdf + 1 + bins, float(target)) - cdf) - 1;
+        bin = std::clamp(bin, 0, bins - 1);
+        while (bin > 0 && cdf[bin + 1] <= cdf[bin])  // Skip empty bins that rounding landed on
+            bin--;
+
+        double span = cdf[bin + 1] - cdf[bin];
+        double offset = span > 0 ? std::clamp((target - cdf[bin]) / span, 0.0, 0.999999) : 0.5;
+
+        int x = bin % phi_bins, y = bin / phi_bins;
+        double cos_theta = -1 + 2 * (y + offset) / cos_bins;
+        double phi = 2 * pi * (x + s.v) / phi_bins;
+        double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+    }
+
+    // Solid-angle density with which sample() returns `direction`. Bins cover equal solid
+    // angles, so the density is flat within each one.
+    double pdf(const region& r, const vec3& direction) const {
+        int bin = bin_of(unit_vector(direction));
+        double mass = (r.cdf[bin + 1] - r.cdf[bin]) / double(r.cdf[bins]);
+        return mass * bins / (4 * pi);
+    }
+
+    // Adds an estimate of the radiance arriving at `p` from `direction`, already divided by the
+    // density of the direction that produced it. Thread-safe.
+    void record(const point3& p, const vec3& direction, double weighted_radiance) const {
+        region& r = find(p);
+        r.samples.fetch_add(1, std::memory_order_relaxed);
+        if (!(weighted_radiance > 0) || !std::isfinite(weighted_radiance))
+            return;
+
+        auto& bin = r.records[bin_of(unit_vector(direction))];
+        float old = bin.load(std::memory_order_relaxed);
+        while (!bin.compare_exchange_weak(old, old + float(weighted_radiance), std::memory_order_relaxed)) {}
+    }
+
+    // Ends a training pass of `pass_samples` samples per pixel: regions that received records
+    // replace their distribution with them, and regions that received more than
+    // split_samples * sqrt(pass_samples) samples split, their children starting from the
+    // parent's new distribution. Records are cleared for the next pass.
+    void refine(int pass_samples, int threads = 0) {
+        parallel_for(regions.size(), threads, [&](size_t i) {
+            region& r = *regions[i];
+            double total = 0;
+            for (int b = 0; b < bins; b++)
+                total += r.records[b].load(std::memory_order_relaxed);
+            if (total <= 0)
+                return;
+
+            // A little of the uniform distribution keeps every direction reachable.
+            r.cdf.resize(bins + 1);
+            r.cdf[0] = 0;
+            double floor = 0.01 * total / bins;
+            for (int b = 0; b < bins; b++)
+                r.cdf[b + 1] = r.cdf[b] + float(r.records[b].load(std::memory_order_relaxed) + floor);
+        });
+
+        double threshold = split_samples * std::sqrt(double(std::max(pass_samples, 1)));
+        size_t node_count = nodes.size();
+        for (size_t i = 0; i < node_count; i++) {
+            if (nodes[i].children >= 0 || nodes[i].half < minimum_size(nodes[0].half))
+                continue;
+            if (regions[nodes[i].region]->samples.load() <= threshold)
+                continue;
+
+            int parent_region = nodes[i].region;
+            int first = int(nodes.size());
+            for (int c = 0; c < 8; c++) {
+                double quarter = 0.5 * nodes[i].half;
+                point3 center = nodes[i].center + vec3((c & 1) ? quarter : -quarter,
+                                                       (c & 2) ? quarter : -quarter,
+                                                       (c & 4) ? quarter : -quarter);
+                int child_region = make_region();
+                regions[child_region]->cdf = regions[parent_region]->cdf;
+                nodes.push_back({center, quarter, -1, child_region});
+            }
+            nodes[i].children = first;
+            nodes[i].region = -1;
+        }
+
+        for (auto& r : regions) {
+            for (int b = 0; b < bins; b++)
+                r->records[b].store(0, std::memory_order_relaxed);
+            r->samples = 0;
+        }
+    }
+
+  private:
+    struct node {
+        point3 center;
+        double half;     // Half the side of the cube
+        int children;    // Index of the first of 8 consecutive children, -1 for a leaf
+        int region;      // Index in `regions` for a leaf
+    };
+
+    static constexpr size_t region_bytes = sizeof(region) + bins * sizeof(std::atomic<float>);  // The CDF is tracked by its allocator
+
+    uint32_t split_samples;
+    std::vector<node> nodes;
+    std::vector<std::unique_ptr<region>> regions;  // Split regions stay allocated but unreachable
+
+    int make_region() {
+        memory_ledger::charge(mem_tag::other, region_bytes);
+        regions.push_back(std::make_unique<region>());
+        return int(regions.size()) - 1;
+    }
+
+    // Regions stop splitting at 1/4096 of the scene's size.
+    static double minimum_size(double root_half) { return root_half / 4096; }
+
+    static int octant(const node& n, const point3& p) {
+        return (p.x() > n.center.x() ? 1 : 0) | (p.y() > n.center.y() ? 2 : 0) | (p.z() > n.center.z() ? 4 : 0);
+    }
+
+    static int bin_of(const vec3& direction) {
+        int y = std::clamp(int((direction.z() + 1) * 0.5 * cos_bins), 0, cos_bins - 1);
+        double phi = std::atan2(direction.y(), direction.x());
+        if (phi < 0)
+            phi += 2 * pi;
+        int x = std::clamp(int(phi / (2 * pi) * phi_bins), 0, phi_bins - 1);
+        return y * phi_bins + x;
+    }
+};
+
+#endif
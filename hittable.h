@@ -3,19 +3,28 @@
 
 #include "rtweekend.h"
 
+#include "aabb.h"
+
 class material;
-class aabb;
+class hittable;
 
 class hit_record {
   public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    const material* mat;  // Owned by the scene's material_table
     double t;
     bool front_face;
     aabb* bbox_ptr;
 
-    hit_record() : bbox_ptr(nullptr) {}
+    // Traversal only records which primitive was hit and where (t and the barycentrics u, v).
+    // p, normal, front_face and mat are filled in by complete(), once, for the closest hit.
+    const hittable* prim;  // Primitive still owing its surface data, or null once complete
+    double u, v;
+    vec3 offset;           // Translation from prim's space to the world, added by instances
+    const hittable* object;  // Primitive whose surface complete() evaluated
+
+    hit_record() : mat(nullptr), bbox_ptr(nullptr), prim(nullptr), u(0), v(0), object(nullptr) {}
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector.
@@ -24,6 +33,18 @@ class hit_record {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    // Records a candidate hit without evaluating the surface.
+    void defer(const hittable* hit_prim, double hit_t, double hit_u = 0, double hit_v = 0) {
+        prim = hit_prim;
+        t = hit_t;
+        u = hit_u;
+        v = hit_v;
+        offset = vec3(0,0,0);
+    }
+
+    // Fills in the surface data of the recorded hit. `r` must be the ray that produced it.
+    inline void complete(const ray& r);
 };
 class hittable {
   public:
@@ -31,6 +52,82 @@ class hittable {
 
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
     virtual void bbox(hit_record& rec) const = 0;
+
+    // Evaluates the hit point, normal and material of a hit this primitive recorded with
+    // hit_record::defer().
+    virtual void surface(const ray& r, hit_record& rec) const {}
+
+    // Light sampling: the solid-angle density with which random() picks `direction` from
+    // `origin`, and a random direction from `origin` towards the object. Only primitives that
+    // can be used as lights implement them.
+    virtual double pdf_value(const point3& origin, const vec3& direction) const {
+        return 0.0;
+    }
+
+    virtual vec3 random(const point3& origin) const {
+        return vec3(1, 0, 0);
+    }
+
+    // Photon emission: a uniformly random point on the surface, the outward (front face)
+    // normal there and the total area. Lights implement it; other primitives return false.
+    virtual bool random_point(point3& point, vec3& normal, double& area) const {
+        return false;
+    }
+};
+
+inline void hit_record::complete(const ray& r) {
+    if (prim) {
+        const hittable* pending = prim;
+        prim = nullptr;
+        object = pending;
+        if (offset.near_zero()) {
+            pending->surface(r, *this);
+        } else {
+            // The primitive evaluates its surface in its own space.
+            pending->surface(ray(r.origin() - offset, r.direction()), *this);
+            p += offset;
+        }
+    }
+}
+
+class translate : public hittable {
+  public:
+    // Places a shared object at an offset. Many instances of one mesh cost one copy of its
+    // triangles and BVH.
+    translate(shared_ptr<hittable> object, const vec3& offset)
+      : object(object), offset(offset) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Move the ray backwards by the offset
+        ray offset_r(r.origin() - offset, r.direction());
+
+        // Determine whether an intersection exists along the offset ray (and if so, where)
+        if (!object->hit(offset_r, ray_t, rec))
+            return false;
+
+        // A deferred hit keeps the offset for complete(), which evaluates the surface in object
+        // space; one already evaluated gets its point moved forwards now.
+        if (rec.prim)
+            rec.offset += offset;
+        else
+            rec.p += offset;
+
+        return true;
+    }
+
+    void bbox(hit_record& rec) const override {
+        object->bbox(rec);
+        if (rec.bbox_ptr) {
+            const aabb& box = *rec.bbox_ptr;
+            *rec.bbox_ptr = aabb(interval(box.x.min + offset.x(), box.x.max + offset.x()),
+                                 interval(box.y.min + offset.y(), box.y.max + offset.y()),
+                                 interval(box.z.min + offset.z(), box.z.max + offset.z()));
+        }
+    }
+
+  private:
+    shared_ptr<hittable> object;
+    vec3 offset;
 };
 
 #endif
\ No newline at end of file
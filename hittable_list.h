@@ -3,13 +3,14 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "memory_ledger.h"
 
 #include <vector>
 #include "rtweekend.h"
 
 class hittable_list : public hittable {
   public:
-    std::vector<shared_ptr<hittable>> objects;
+    tracked_vector<shared_ptr<hittable>> objects;  // Charged to the memory_scope it was created in
 
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
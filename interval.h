@@ -1,36 +1,47 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
-class interval {
+#include <limits>
+
+template <typename T>
+class basic_interval {
   public:
-    double min, max;
+    T min, max;
 
-    interval() : min(+infinity), max(-infinity) {} // Default interval is empty
+    basic_interval() : min(+inf()), max(-inf()) {} // Default interval is empty
 
-    interval(double min, double max) : min(min), max(max) {}
+    basic_interval(T min, T max) : min(min), max(max) {}
 
-    double size() const {
+    T size() const {
         return max - min;
     }
 
-    double clamp(double x) const {
+    T clamp(T x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
     }
 
-    bool contains(double x) const {
+    bool contains(T x) const {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) const {
+    bool surrounds(T x) const {
         return min < x && x < max;
     }
 
-    static const interval empty, universe;
+    static const basic_interval empty, universe;
+
+  private:
+    static constexpr T inf() { return std::numeric_limits<T>::infinity(); }
 };
 
-const interval interval::empty    = interval(+infinity, -infinity);
-const interval interval::universe = interval(-infinity, +infinity);
+template <typename T>
+const basic_interval<T> basic_interval<T>::empty    = basic_interval<T>(+inf(), -inf());
+template <typename T>
+const basic_interval<T> basic_interval<T>::universe = basic_interval<T>(-inf(), +inf());
+
+using interval  = basic_interval<double>;
+using intervalf = basic_interval<float>;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sampler.h"
+
+#include <unordered_set>
+#include <vector>
+
+// The emitting primitives of a scene, for next-event estimation. They must also be part of the
+// world, as the very same objects (not copies or translated instances), so that a shadow ray
+// can tell whether it reached the light it was aimed at.
+class light_list {
+  public:
+    void add(shared_ptr<hittable> light) {
+        if (members.insert(light.get()).second)
+            lights.push_back(light);
+    }
+
+    void add(const hittable_list& list) {
+        for (const auto& object : list.objects)
+            add(object);
+    }
+
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+    bool contains(const hittable* object) const { return members.count(object) != 0; }
+
+    // Picks a light uniformly and returns a random direction from `origin` towards it.
+    vec3 random(const point3& origin, const hittable*& chosen) const {
+        size_t index = std::min(lights.size() - 1, size_t(sample_1d() * lights.size()));
+        chosen = lights[index].get();
+        return chosen->random(origin);
+    }
+
+    // Picks a light uniformly and a uniformly random point on it, for emitting photons. `area`
+    // is the light's area divided by the chance of picking it.
+    bool random_point(point3& point, vec3& normal, double& area, const hittable*& chosen) const {
+        size_t index = std::min(lights.size() - 1, size_t(sample_1d() * lights.size()));
+        chosen = lights[index].get();
+        if (!chosen->random_point(point, normal, area))
+            return false;
+        area *= double(lights.size());
+        return true;
+    }
+
+    // Density of random() producing `direction` through `light`.
+    double pdf_value(const hittable& light, const point3& origin, const vec3& direction) const {
+        return light.pdf_value(origin, direction) / double(lights.size());
+    }
+
+  private:
+    std::vector<shared_ptr<hittable>> lights;
+    std::unordered_set<const hittable*> members;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef LOD_GROUP_H
+#define LOD_GROUP_H
+
+#include "hittable.h"
+#include "aabb.h"
+
+#include <vector>
+
+// Several versions of one object at decreasing resolution. The group uses the coarsest level
+// whose triangles still look no bigger than `max_triangle_footprints` pixels from the camera:
+// close instances get the full mesh, distant ones the simplified versions.
+//
+// The level is picked once per instance and view, not per ray, so that every ray of a render
+// (camera, shadow and bounce rays alike) sees the same surface. Rays that switched levels
+// along a path would start on one mesh and hit the other right away, or slip through the
+// gaps between them.
+class lod_group : public hittable {
+  public:
+    double max_triangle_footprints = 2.0;
+
+    // Levels are added from finest to coarsest. `triangle_count` drives the selection.
+    void add_level(shared_ptr<hittable> object, size_t triangle_count) {
+        levels.push_back({object, double(triangle_count)});
+
+        if (levels.size() == 1) {
+            // The finest level defines the bounds used for selection.
+            hit_record rec;
+            object->bbox(rec);
+            if (rec.bbox_ptr) {
+                bounds = *rec.bbox_ptr;
+                delete rec.bbox_ptr;
+            }
+            center = point3((bounds.x.min + bounds.x.max) / 2,
+                            (bounds.y.min + bounds.y.max) / 2,
+                            (bounds.z.min + bounds.z.max) / 2);
+            radius = 0.5 * std::sqrt(bounds.x.size()*bounds.x.size()
+                                   + bounds.y.size()*bounds.y.size()
+                                   + bounds.z.size()*bounds.z.size());
+        }
+    }
+
+    // A group that shares these levels, for an instance moved by `offset` (with translate).
+    // It picks its level from its own distance to the camera.
+    shared_ptr<lod_group> placed_at(const vec3& offset) const {
+        auto instance = make_shared<lod_group>(*this);
+        instance->center += offset;
+        return instance;
+    }
+
+    // Picks the level for a camera at `eye` whose pixels subtend `pixel_spread` radians.
+    // Until it is called the group uses its finest level.
+    void set_view(const point3& eye, double pixel_spread) {
+        current = select(eye, pixel_spread);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (levels.empty())
+            return false;
+        return levels[current].object->hit(r, ray_t, rec);
+    }
+
+    void bbox(hit_record& rec) const override {
+        rec.bbox_ptr = levels.empty() ? nullptr : new aabb(bounds);
+    }
+
+    // Index of the level seen from `eye`.
+    size_t select(const point3& eye, double pixel_spread) const {
+        // Object size across, measured in pixel footprints at its distance.
+        double distance = std::fmax((center - eye).length() - radius, 0.0);
+        double footprint = pixel_spread * distance;
+        if (footprint <= 0)
+            return 0;
+        double projected = 2 * radius / footprint;
+
+        size_t chosen = 0;
+        for (size_t i = 1; i < levels.size(); i++) {
+            // A mesh of n triangles spans about sqrt(n) triangles across.
+            double triangle_size = projected / std::sqrt(levels[i].triangle_count);
+            if (triangle_size > max_triangle_footprints)
+                break;
+            chosen = i;
+        }
+        return chosen;
+    }
+
+    size_t level_count() const { return levels.size(); }
+    size_t current_level() const { return current; }
+
+  private:
+    struct level {
+        shared_ptr<hittable> object;
+        double triangle_count;
+    };
+
+    std::vector<level> levels;
+    aabb bounds;
+    point3 center;
+    double radius = 0;
+    size_t current = 0;
+};
+
+#endif
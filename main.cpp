@@ -10,7 +10,16 @@
 #include "triangle.h"
 #include "material.h"
 #include "obj_loader.h"
+#include "mesh_loader.h"
+#include "clusters.h"
 #include "bvh.h"
+#include "lod_group.h"
+#include "light_list.h"
+#include "environment_map.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 
 // Auto camera globals (set when scene bbox is available)
 static point3 AUTO_CAM_POS = point3(0,0,0);
@@ -18,23 +27,149 @@ static point3 AUTO_CAM_LOOKAT = point3(0,0,0);
 static bool AUTO_CAM_SET = false;
 
 #define USE_OBJ true  // true = usar .obj | false = usar teste com esfera
+#define USE_WATERTIGHT false  // true = intersecao watertight | false = Moller-Trumbore
+#define LOD_CROWD 0  // > 0 = grade LOD_CROWD x LOD_CROWD de canecas instanciadas
+#define USE_ARENA true  // true = triangulos e nos da BVH alocados em blocos contiguos
 
-int main() {
+#define INDOOR_SCENE false  // true = cena dentro de uma sala fechada, iluminada so por uma luminaria no teto
+#define LAMP_OBJ ""  // Malha .obj emissiva usada como luminaria da sala, nas coordenadas da cena; "" = quadrado no teto
+#define USE_NEE true  // true = luzes amostradas diretamente com raios de sombra (MIS) | false = so por acaso
+#define ENVIRONMENT_MAP ""  // Caminho de um mapa de ambiente HDR (.pfm equiretangular) que substitui o ceu
+#define ENVIRONMENT_INTENSITY 1.0
+#define SAMPLER sampler_type::sobol  // independent, halton, sobol (Owen embaralhado) ou blue_noise
+#define DENOISE false  // true = renderiza com 128 amostras e filtra o ruido restante (a-trous guiado por albedo, normal e profundidade)
+#define FEATURE_OUTPUT ""  // Prefixo para gravar os buffers de albedo, normal e profundidade (.pfm); "" = nao grava
+#define CAUSTIC_PHOTONS 0  // Fotons lancados das luzes para as causticas (luz focada por metal polido ou vidro), ex. 1000000; 0 = sem mapa de fotons
+#define GUIDING false  // true = aprende de onde vem a luz em passadas de treino e mira os rebotes difusos e brilhantes nela
+
+#define ANIMATION_FRAMES 0  // > 0 = gira a camera em volta da cena nesse numero de quadros (frame_000.png, frame_001.png, ...)
+#define ANIMATION_DEGREES 360.0  // Angulo total do giro
+#define TEMPORAL_REUSE true  // true = cada quadro da animacao reaproveita as amostras do anterior e renderiza so 1/8 das amostras
+
+#define MEMORY_BUDGET_MB 0  // > 0 = limite de memoria da cena; acima dele cai para a malha simplificada ou aborta
+#define OUT_OF_CORE_MB 256  // > 0 = malhas com versao .rtclusters sao lidas sob demanda, com este limite de cache
+
+#define RAW_OUTPUT ""  // "" = so o PNG | "-" = quadros crus na saida padrao | caminho = arquivo ou pipe nomeado
+#define RAW_FORMAT frame_format::rgb8  // rgb8, rgb16 ou rgb_float (linear)
+#define RAW_MAPPED false  // true = RAW_OUTPUT e um arquivo pre-alocado e mapeado em memoria
+
+#if INDOOR_SCENE
+// Quadrilatero q, q+u, q+u+v, q+v como dois triangulos; a face da frente aponta para u x v.
+static void add_quad(hittable_list& list, const point3& q, const vec3& u, const vec3& v, const material* mat) {
+    list.add(make_shared<triangle>(q, q + u, q + u + v, mat));
+    list.add(make_shared<triangle>(q, q + u + v, q + v, mat));
+}
+#endif
+
+static int render_scene() {
     hittable_list world;
+    light_list lights;
+    material_table materials;
+    std::vector<std::unique_ptr<scene_arena>> arenas;  // Precisam viver enquanto a cena existir
+    std::vector<std::unique_ptr<mesh_file>> meshes;    // Malhas binarias mapeadas, idem
+    std::vector<shared_ptr<cluster_set>> streamed;     // Malhas fora da memoria, para o relatorio do cache
+    std::vector<shared_ptr<lod_group>> lod_groups;     // Escolhem o nivel pela distancia ate a camera
+    triangle::watertight = USE_WATERTIGHT;
 
     #if USE_OBJ
         std::cout << "*-*-*-*-*-* Modo: carregando arquivo obj *-*-*-*-*-*" << std::endl;
         std::string obj_file = "objetos/caneca_tras.obj";
-        auto material_object = make_shared<metal>(color(0.85, 0.7, 0.2), 0.05);
-        
-        std::cout << "Carregando arquivo: " << obj_file << std::endl;
-        hittable_list obj_world = obj_loader::load(obj_file, material_object);
-        
-        std::cout << "Triangulos carregados: " << obj_world.objects.size() << std::endl;
-        
-        if (obj_world.objects.size() > 0) {
-            world.add(make_shared<bvh_node>(obj_world));
-            std::cout << "BVH compilado!" << std::endl;
+        std::string obj_file_lod = "objetos/caneca_simplificada_tras.obj";  // Nivel de detalhe reduzido
+        auto material_object = materials.add<metal>(color(0.85, 0.7, 0.2), 0.05);
+
+        // Carrega uma malha direto numa BVH, em paralelo, com arenas proprias do nivel. Se
+        // existir a versao binaria (.rtmesh, gerada pelo obj2mesh), ela e mapeada na memoria
+        // sem interpretar texto; se existir a versao em clusters (.rtclusters), so os limites
+        // dos clusters sao lidos e a geometria entra sob demanda durante a renderizacao. Se o
+        // orcamento de memoria estourar no meio do caminho, libera tudo o que o nivel alocou e
+        // retorna nulo.
+        auto load_level = [&](const std::string& file, size_t& triangles) -> shared_ptr<hittable> {
+            std::vector<std::unique_ptr<scene_arena>> level_arenas;
+            triangles = 0;
+            try {
+                std::string base = file.substr(0, file.rfind('.'));
+                std::string binary_file = base + ".rtmesh";
+                std::string cluster_file = base + ".rtclusters";
+                shared_ptr<hittable> node;
+                if (OUT_OF_CORE_MB > 0 && std::ifstream(cluster_file).good()) {
+                    std::cout << "Abrindo clusters: " << cluster_file << std::endl;
+                    auto clusters = make_shared<cluster_set>(cluster_file, material_object, size_t(OUT_OF_CORE_MB) << 20);
+                    if (clusters->valid()) {
+                        streamed.push_back(clusters);
+                        node = clusters;
+                        triangles = clusters->triangle_count();
+                        std::cout << clusters->clusters().cluster_count() << " clusters, cache de "
+                                  << OUT_OF_CORE_MB << " MiB" << std::endl;
+                    }
+                } else if (std::ifstream(binary_file).good()) {
+                    std::cout << "Mapeando arquivo: " << binary_file << std::endl;
+                    meshes.push_back(std::make_unique<mesh_file>(binary_file));
+                    node = mesh_loader::load_bvh(*meshes.back(), material_object, USE_ARENA ? &level_arenas : nullptr);
+                    triangles = node ? mesh_loader::last_stats.triangles : 0;
+                    std::cout << "Mapeamento + BVH: " << mesh_loader::last_stats.seconds * 1e3 << " ms" << std::endl;
+                } else {
+                    std::cout << "Carregando arquivo: " << file << std::endl;
+                    node = obj_loader::load_bvh(file, material_object, USE_ARENA ? &level_arenas : nullptr);
+                    const auto& stats = obj_loader::last_stats;
+                    std::cout << "Leitura + BVH: " << stats.megabytes_per_second() << " MB/s ("
+                              << stats.chunks << " blocos)" << std::endl;
+                    triangles = stats.triangles;
+                }
+
+                for (auto& arena : level_arenas)
+                    arenas.push_back(std::move(arena));
+                return node;
+            } catch (const memory_budget_exceeded& e) {
+                std::cout << "Orcamento de memoria excedido em " << file << " (" << e.what() << ")" << std::endl;
+                return nullptr;
+            }
+        };
+
+        auto load_start = std::chrono::steady_clock::now();
+        size_t triangles = 0, triangles_lod = 0;
+        auto detailed = load_level(obj_file, triangles);
+        auto simplified = load_level(obj_file_lod, triangles_lod);
+
+        std::cout << "Triangulos carregados: " << triangles
+                  << " (LOD: " << triangles_lod << ")" << std::endl;
+
+        if (detailed || simplified) {
+            if (!detailed)
+                std::cout << "Usando apenas a malha simplificada" << std::endl;
+
+            // Cada instancia escolhe a malha pelo seu tamanho projetado na camera, uma vez por quadro
+            auto caneca = make_shared<lod_group>();
+            if (detailed)
+                caneca->add_level(detailed, triangles);
+            if (simplified)
+                caneca->add_level(simplified, triangles_lod);
+
+            #if LOD_CROWD > 0
+                // Multidao de instancias compartilhando as mesmas malhas
+                hittable_list crowd;
+                for (int a = 0; a < LOD_CROWD; a++)
+                    for (int b = 0; b < LOD_CROWD; b++) {
+                        vec3 offset(12.0 * a, 0, -12.0 * b);
+                        lod_groups.push_back(caneca->placed_at(offset));
+                        crowd.add(make_shared<translate>(lod_groups.back(), offset));
+                    }
+                world.add(make_shared<bvh_node>(crowd));
+            #else
+                lod_groups.push_back(caneca);
+                world.add(caneca);
+            #endif
+            std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+            size_t arena_bytes = 0;
+            for (const auto& arena : arenas)
+                arena_bytes += arena->bytes_used();
+            std::cout << "BVH compilado! Carga + construcao: " << load_time.count() << " s"
+                      << " | RSS: " << resident_memory_bytes() / (1024 * 1024) << " MiB"
+                      << " | arena: " << arena_bytes / 1024 << " KiB" << std::endl;
+
+            std::cout << "Precisao da travessia: " << (sizeof(traversal_real) == 4 ? "float" : "double")
+                      << " | BVH: " << bvh_node::built << " nos, "
+                      << triangle_block::built + mesh_triangle_block::built << " folhas" << std::endl;
+            memory_ledger::report(std::cout);
         } else {
             std::cout << "ERRO: Nenhum triangulo carregado!" << std::endl;
             return 1;
@@ -42,8 +177,8 @@ int main() {
 
         // Adicionar 2 esferas metálicas para refletir
         std::cout << "Adicionando esferas metálicas..." << std::endl;
-        auto material_metal_red = make_shared<metal>(color(0.9, 0.3, 0.2), 0.1);
-        auto material_metal_blue = make_shared<metal>(color(0.2, 0.4, 0.9), 0.15);
+        auto material_metal_red = materials.add<metal>(color(0.9, 0.3, 0.2), 0.1);
+        auto material_metal_blue = materials.add<metal>(color(0.2, 0.4, 0.9), 0.15);
         
         world.add(make_shared<sphere>(point3(-8, 8, -5), 2.0, material_metal_red));
         world.add(make_shared<sphere>(point3(12, 6, 8), 1.5, material_metal_blue));
@@ -72,29 +207,73 @@ int main() {
             AUTO_CAM_POS = cam_pos;
             AUTO_CAM_LOOKAT = center;
             AUTO_CAM_SET = true;
+
+            #if INDOOR_SCENE
+                // Sala em volta da cena (e da camera), com uma luminaria quadrada no teto
+                std::cout << "Montando a sala fechada..." << std::endl;
+                auto white = materials.add<lambertian>(color(.73, .73, .73));
+                auto red = materials.add<lambertian>(color(.65, .05, .05));
+                auto green = materials.add<lambertian>(color(.12, .45, .15));
+                auto lamp_light = materials.add<diffuse_light>(color(15, 15, 15));
+
+                double half = distance + 0.5 * radius;
+                point3 lo(center.x() - half, min_y, center.z() - half);
+                double size = 2 * half;
+                add_quad(world, lo, vec3(0, 0, size), vec3(size, 0, 0), white);                      // chao
+                add_quad(world, lo + vec3(0, size, 0), vec3(size, 0, 0), vec3(0, 0, size), white);   // teto
+                add_quad(world, lo, vec3(0, size, 0), vec3(0, 0, size), red);                        // esquerda
+                add_quad(world, lo + vec3(size, 0, 0), vec3(0, 0, size), vec3(0, size, 0), green);   // direita
+                add_quad(world, lo, vec3(size, 0, 0), vec3(0, size, 0), white);                      // fundo
+                add_quad(world, lo + vec3(0, 0, size), vec3(0, size, 0), vec3(size, 0, 0), white);   // atras da camera
+
+                // Os triangulos da luminaria vao para a lista de luzes como os mesmos objetos da cena
+                hittable_list lamp;
+                if (std::string(LAMP_OBJ) != "") {
+                    if (auto lamp_mesh = obj_loader::load_bvh(LAMP_OBJ, lamp_light, USE_ARENA ? &arenas : nullptr, 0, &lamp))
+                        world.add(lamp_mesh);
+                    std::cout << "Luminaria: " << LAMP_OBJ << " (" << lamp.objects.size() << " triangulos)" << std::endl;
+                }
+                if (lamp.objects.empty()) {
+                    double lamp_size = 1.5 * radius;
+                    add_quad(lamp, point3(center.x() - lamp_size / 2, min_y + size - 0.01 * size, center.z() - lamp_size / 2),
+                             vec3(lamp_size, 0, 0), vec3(0, 0, lamp_size), lamp_light);
+                    for (const auto& triangle : lamp.objects)
+                        world.add(triangle);
+                }
+                lights.add(lamp);
+            #endif
         }
     #else
         std::cout << "*-*-*-*-*-* Modo: teste com esferas *-*-*-*-*-*" << std::endl;
         
-        auto material_red = make_shared<lambertian>(color(1.0, 0.2, 0.2));
+        auto material_red = materials.add<lambertian>(color(1.0, 0.2, 0.2));
         world.add(make_shared<sphere>(point3(-0.5, 0, -2), 0.5, material_red));
         
-        auto material_blue = make_shared<lambertian>(color(0.2, 0.2, 1.0));
+        auto material_blue = materials.add<lambertian>(color(0.2, 0.2, 1.0));
         world.add(make_shared<sphere>(point3(0.5, 0, -2), 0.5, material_blue));
         
-        auto material_ground = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+        auto material_ground = materials.add<lambertian>(color(0.5, 0.5, 0.5));
         world.add(make_shared<sphere>(point3(0, -100.5, -2), 100.0, material_ground));
         
         std::cout << "Objetos adicionados: " << world.objects.size() << std::endl;
+
+        // A BVH agrupa as esferas em folhas sphere_set, testadas varias de uma vez.
+        world = hittable_list(make_shared<bvh_node>(world));
     #endif
 
     camera cam;
 
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 4800;          // maior -> melhor qualidade
-    cam.samples_per_pixel = 1200;          // maior -> menos ruído
+    cam.samples_per_pixel = 512;           // maior -> menos ruído (potencia de dois rende mais com Sobol)
     cam.max_depth         = 40;           // maior -> reflexões mais profundas
 
+    #if DENOISE
+        cam.denoise = true;
+        cam.samples_per_pixel = 128;       // o filtro remove o ruído que sobra
+    #endif
+    cam.feature_output = FEATURE_OUTPUT;
+
     #if USE_OBJ
         cam.vfov = 40;
         if (AUTO_CAM_SET) {
@@ -117,7 +296,84 @@ int main() {
     cam.vup           = vec3(0, 1, 0);
     cam.defocus_angle = 0.0;
 
-    cam.render(world);
-    std::cout << "Renderizacao completa!" << std::endl;
-    std::cout << "Resultado salvo em: output.png" << std::endl;
+    #if INDOOR_SCENE
+        cam.sky = false;  // So a luminaria ilumina a sala
+    #endif
+    if (!lights.empty())
+        cam.lights = &lights;
+    cam.next_event = USE_NEE;
+    for (const auto& group : lod_groups)
+        cam.lod_groups.push_back(group.get());
+    cam.sampling = SAMPLER;
+    cam.guiding = GUIDING;
+    cam.caustic_photons = CAUSTIC_PHOTONS;
+
+    std::unique_ptr<environment_map> environment;
+    if (std::string(ENVIRONMENT_MAP) != "") {
+        environment = std::make_unique<environment_map>(ENVIRONMENT_MAP, ENVIRONMENT_INTENSITY);
+        if (environment->valid()) {
+            std::cout << "Mapa de ambiente: " << ENVIRONMENT_MAP << " (" << environment->image_width()
+                      << "x" << environment->image_height() << ")" << std::endl;
+            cam.environment = environment.get();
+        } else {
+            std::cout << "Mapa de ambiente invalido, usando o ceu padrao" << std::endl;
+        }
+    }
+
+    // Com saida crua, os quadros vao direto para o consumidor e o PNG nao e gerado
+    std::string raw_output = RAW_OUTPUT;
+    std::unique_ptr<frame_stream> raw_frames;
+    if (!raw_output.empty()) {
+        raw_frames = std::make_unique<frame_stream>(raw_output, RAW_FORMAT, RAW_MAPPED);
+        cam.raw_frames = raw_frames.get();
+        cam.png_output.clear();
+    }
+
+    auto render_start = std::chrono::steady_clock::now();
+    #if ANIMATION_FRAMES > 0
+        // Giro da camera em torno do eixo vertical que passa pelo ponto observado
+        cam.temporal_reuse = TEMPORAL_REUSE;
+        if (TEMPORAL_REUSE)
+            cam.samples_per_pixel = std::max(1, cam.samples_per_pixel / 8);
+        vec3 orbit = cam.lookfrom - cam.lookat;
+        for (int frame = 0; frame < ANIMATION_FRAMES; frame++) {
+            double angle = degrees_to_radians(ANIMATION_DEGREES) * frame / ANIMATION_FRAMES;
+            double c = std::cos(angle), s = std::sin(angle);
+            cam.lookfrom = cam.lookat + vec3(c * orbit.x() + s * orbit.z(), orbit.y(), -s * orbit.x() + c * orbit.z());
+            if (!raw_frames) {
+                char name[32];
+                std::snprintf(name, sizeof(name), "frame_%03d.png", frame);
+                cam.png_output = name;
+            }
+            std::cout << "Quadro " << (frame + 1) << "/" << ANIMATION_FRAMES << std::endl;
+            cam.render(world);
+        }
+    #else
+        cam.render(world);
+    #endif
+    std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - render_start;
+    std::cout << "Renderizacao completa em " << render_time.count() << " s" << std::endl;
+    if (raw_frames)
+        std::cout << "Quadro cru enviado para: " << (raw_output == "-" ? "saida padrao" : raw_output)
+                  << (raw_frames->failed() ? " (com erro)" : "") << std::endl;
+    else if (ANIMATION_FRAMES > 0)
+        std::cout << "Quadros salvos em: frame_000.png ... " << cam.png_output << std::endl;
+    else
+        std::cout << "Resultado salvo em: " << cam.png_output << std::endl;
+    for (const auto& clusters : streamed)
+        clusters->clusters().report(std::cout);
+    memory_ledger::report(std::cout);
+    return 0;
+}
+
+int main() {
+    if (std::string(RAW_OUTPUT) == "-")
+        frame_stream::claim_stdout();  // Mensagens vao para stderr, a saida padrao fica so com os quadros
+    memory_ledger::set_budget(size_t(MEMORY_BUDGET_MB) << 20);
+    try {
+        return render_scene();
+    } catch (const memory_budget_exceeded& e) {
+        std::cout << "ERRO: " << e.what() << std::endl;
+        return 1;
+    }
 }
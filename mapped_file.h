@@ -0,0 +1,81 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include "memory_ledger.h"
+
+#include <string>
+
+#if defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped, so parsers scan
+// the page cache directly; elsewhere it is read into one buffer (charged to the I/O tag).
+class mapped_file {
+  public:
+    mapped_file() = default;
+
+    explicit mapped_file(const std::string& path) {
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+            return;
+        buffer.resize(size_t(file.tellg()));
+        file.seekg(0);
+        file.read(buffer.data(), std::streamsize(buffer.size()));
+        bytes = buffer.data();
+        length = buffer.size();
+        opened = true;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            opened = true;
+            length = size_t(info.st_size);
+            if (length > 0) {
+                void* view = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (view == MAP_FAILED) {
+                    opened = false;
+                    length = 0;
+                } else {
+                    madvise(view, length, MADV_SEQUENTIAL);
+                    bytes = static_cast<const char*>(view);
+                }
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    ~mapped_file() {
+#if !defined(_WIN32)
+        if (bytes)
+            munmap(const_cast<char*>(bytes), length);
+#endif
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool is_open() const { return opened; }
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+    bool opened = false;
+#if defined(_WIN32)
+    tracked_vector<char> buffer{tracking_allocator<char>(mem_tag::io)};
+#endif
+};
+
+#endif
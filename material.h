@@ -2,6 +2,11 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "memory_ledger.h"
+#include "onb.h"
+#include "warp.h"
+
+#include <vector>
 
 class material {
   public:
@@ -12,21 +17,64 @@ class material {
     ) const {
         return false;
     }
+
+    // Radiance the surface emits towards the incoming ray.
+    virtual color emitted(const ray& r_in, const hit_record& rec) const {
+        return color(0,0,0);
+    }
+
+    // Solid-angle density with which scatter() picks the direction of `scattered`. The
+    // integrator takes attenuation * scattering_pdf as the BSDF times the cosine, so materials
+    // that return 0 (mirror-like or refracting ones) are never sampled through lights.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    const {
+        return 0;
+    }
+
+    // Whether scattering_pdf() describes the directions scatter() picks. Mirror-like and
+    // refracting materials have a single direction with no density; they are neither light
+    // sampled nor guided.
+    virtual bool has_scattering_pdf() const {
+        return false;
+    }
+
+    // Whether the material scatters into so narrow a lobe that paths from a diffuse surface
+    // can't find lights through it. Light focused by such surfaces (caustics) comes from the
+    // photon map instead.
+    virtual bool specular() const {
+        return !has_scattering_pdf();
+    }
+
+    // Surface color the denoiser factors out of the lighting before filtering, so that it
+    // stays sharp. Materials without one leave the lighting as it is.
+    virtual color feature_albedo() const {
+        return color(1,1,1);
+    }
 };
+
 class lambertian : public material {
   public:
     lambertian(const color& albedo) : albedo(albedo) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        // Cosine-weighted around the normal, so every sample carries exactly the albedo.
+        onb uvw(rec.normal);
+        scattered = ray(rec.p, uvw.transform(cosine_hemisphere(sample_2d())));
+        attenuation = albedo;
+        return true;
+    }
 
-        // Catch degenerate scatter direction
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
+    color feature_albedo() const override {
+        return albedo;
+    }
 
-        scattered = ray(rec.p, scatter_direction);
-        attenuation = albedo;
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    const override {
+        return cosine_hemisphere_pdf(dot(rec.normal, unit_vector(scattered.direction())));
+    }
+
+    bool has_scattering_pdf() const override {
         return true;
     }
 
@@ -34,25 +82,62 @@ class lambertian : public material {
     color albedo;
 };
 
+// Fuzzy reflection: the incoming ray is mirrored about a microfacet normal drawn from a GGX
+// distribution whose roughness grows with `fuzz`. The lobe carries `albedo` times its own
+// density (it has no masking or Fresnel terms), so every sample has weight `albedo` and the
+// lobe can be light sampled. Reflections that end up below the surface are absorbed.
 class metal : public material {
   public:
     metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
     bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered)
     const override {
-      vec3 reflected = reflect(r_in.direction(), rec.normal);
-      // Normalize and add fuzz perturbation
-      reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-      // Ensure the scattered ray doesn't point back into the surface
-      reflected = unit_vector(reflected);
-      scattered = ray(rec.p, reflected);
-      attenuation = albedo;
-      return (dot(scattered.direction(), rec.normal) > 0);
+        vec3 facet = rec.normal;
+        if (glossy()) {
+            onb uvw(rec.normal);
+            facet = uvw.transform(ggx_normal(sample_2d(), roughness()));
+        }
+        scattered = ray(rec.p, reflect(unit_vector(r_in.direction()), facet));
+        attenuation = albedo;
+        return (dot(scattered.direction(), rec.normal) > 0);
+    }
+
+    color feature_albedo() const override {
+        return albedo;
+    }
+
+    double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered)
+    const override {
+        if (!glossy())
+            return 0;  // A mirror: only the reflected ray itself can find the lights
+
+        vec3 out = unit_vector(scattered.direction());
+        vec3 half = out - unit_vector(r_in.direction());
+        if (dot(out, rec.normal) <= 0 || half.near_zero())
+            return 0;
+        half = unit_vector(half);
+
+        // Density of the facet normal, times the Jacobian of reflecting about it.
+        return ggx_normal_pdf(dot(half, rec.normal), roughness()) / (4 * dot(out, half));
+    }
+
+    bool has_scattering_pdf() const override {
+        return glossy();
+    }
+
+    bool specular() const override {
+        return fuzz < 0.2;
     }
 
   private:
     color albedo;
     double fuzz;
+
+    bool glossy() const { return fuzz > 1e-3; }
+
+    // GGX roughness that makes the lobe about as wide as the book's fuzz sphere: reflecting
+    // about a tilted facet turns the reflection by twice the tilt.
+    double roughness() const { return 0.5 * fuzz; }
 };
 
 class dielectric : public material {
@@ -65,22 +150,18 @@ class dielectric : public material {
         double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
 
         vec3 unit_direction = unit_vector(r_in.direction());
-        vec3 refracted = refract(unit_direction, rec.normal, ri);
-
         double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
         double sin_theta = std::sqrt(1.0 - cos_theta*cos_theta);
 
         bool cannot_refract = ri * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, ri) > random_double())
+        if (cannot_refract || reflectance(cos_theta, ri) > sample_1d())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, ri);
 
         scattered = ray(rec.p, direction);
-
-        scattered = ray(rec.p, refracted);
         return true;
     }
 
@@ -97,4 +178,45 @@ class dielectric : public material {
     }
 };
 
+class diffuse_light : public material {
+  public:
+    diffuse_light(const color& emit) : emit(emit) {}
+
+    // Emits from its front face only.
+    color emitted(const ray& r_in, const hit_record& rec) const override {
+        if (!rec.front_face)
+            return color(0,0,0);
+        return emit;
+    }
+
+  private:
+    color emit;
+};
+
+// Owns every material of a scene. Primitives and hit records refer to materials through plain
+// pointers into this table, so recording a hit never touches a reference count. The table must
+// outlive the scene and any render that uses it.
+class material_table {
+  public:
+    material_table() : materials(tracking_allocator<std::unique_ptr<material>>(mem_tag::materials)) {}
+    material_table(const material_table&) = delete;
+    material_table& operator=(const material_table&) = delete;
+
+    ~material_table() { memory_ledger::release(mem_tag::materials, bytes); }
+
+    template <typename T, typename... Args>
+    const material* add(Args&&... args) {
+        memory_ledger::charge(mem_tag::materials, sizeof(T));
+        bytes += sizeof(T);
+        materials.push_back(std::make_unique<T>(std::forward<Args>(args)...));
+        return materials.back().get();
+    }
+
+    size_t size() const { return materials.size(); }
+
+  private:
+    tracked_vector<std::unique_ptr<material>> materials;
+    size_t bytes = 0;
+};
+
 #endif
\ No newline at end of file
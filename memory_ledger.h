@@ -0,0 +1,168 @@
+#ifndef MEMORY_LEDGER_H
+#define MEMORY_LEDGER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Memory accounting by subsystem.
+//
+// Scene allocations are charged to a tag (mesh, BVH, materials, framebuffer, I/O buffers) in a
+// process-wide ledger, which keeps the current and peak bytes of each. With a budget set, a
+// charge that would exceed it throws memory_budget_exceeded before the memory is allocated, so
+// a scene too large for the machine fails at load time instead of being OOM-killed mid-render.
+
+enum class mem_tag { mesh, bvh, materials, framebuffer, io, other, count };
+
+inline const char* mem_tag_name(mem_tag tag) {
+    switch (tag) {
+        case mem_tag::mesh:        return "malha";
+        case mem_tag::bvh:         return "BVH";
+        case mem_tag::materials:   return "materiais";
+        case mem_tag::framebuffer: return "framebuffer";
+        case mem_tag::io:          return "buffers de E/S";
+        default:                   return "outros";
+    }
+}
+
+class memory_budget_exceeded : public std::bad_alloc {
+  public:
+    memory_budget_exceeded(mem_tag tag, size_t requested, size_t in_use, size_t budget)
+      : message("memory budget exceeded: " + std::to_string(requested) + " bytes for "
+                + mem_tag_name(tag) + " with " + std::to_string(in_use) + " of "
+                + std::to_string(budget) + " bytes in use") {}
+
+    const char* what() const noexcept override { return message.c_str(); }
+
+  private:
+    std::string message;
+};
+
+class memory_ledger {
+  public:
+    static constexpr int tag_count = int(mem_tag::count);
+
+    // Throws memory_budget_exceeded, leaving the ledger unchanged, if `bytes` do not fit.
+    static void charge(mem_tag tag, size_t bytes) {
+        // The total only moves once the charge is known to fit, so a charge that is refused
+        // never makes a concurrent one look over budget.
+        size_t in_use = total_bytes.load();
+        do {
+            if (budget_bytes && bytes > budget_bytes - std::min(in_use, budget_bytes))
+                throw memory_budget_exceeded(tag, bytes, in_use, budget_bytes);
+        } while (!total_bytes.compare_exchange_weak(in_use, in_use + bytes));
+
+        auto& entry = entries[int(tag)];
+        size_t now = entry.current.fetch_add(bytes) + bytes;
+        size_t peak = entry.peak.load();
+        while (now > peak && !entry.peak.compare_exchange_weak(peak, now)) {}
+    }
+
+    static void release(mem_tag tag, size_t bytes) {
+        entries[int(tag)].current -= bytes;
+        total_bytes -= bytes;
+    }
+
+    static size_t current(mem_tag tag) { return entries[int(tag)].current; }
+    static size_t peak(mem_tag tag) { return entries[int(tag)].peak; }
+    static size_t total() { return total_bytes; }
+
+    // Zero disables the budget.
+    static void set_budget(size_t bytes) { budget_bytes = bytes; }
+    static size_t budget() { return budget_bytes; }
+
+    // Whether `bytes` more can be charged without exceeding the budget.
+    static bool fits(size_t bytes) { return !budget_bytes || total_bytes + bytes <= budget_bytes; }
+
+    static void report(std::ostream& out) {
+        out << "Memoria por subsistema (atual / pico, KiB):\n";
+        for (int i = 0; i < tag_count; i++) {
+            if (!entries[i].peak)
+                continue;
+            out << "  " << mem_tag_name(mem_tag(i)) << ": " << kib(entries[i].current)
+                << " / " << kib(entries[i].peak) << "\n";
+        }
+        out << "  total: " << kib(total_bytes) << " KiB";
+        if (budget_bytes)
+            out << " de " << kib(budget_bytes) << " KiB do orcamento";
+        out << std::endl;
+    }
+
+  private:
+    static std::string kib(size_t bytes) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.1f", bytes / 1024.0);
+        return text;
+    }
+
+    struct entry {
+        std::atomic<size_t> current;  // Zero-initialized, as the ledger has static storage
+        std::atomic<size_t> peak;
+    };
+
+    static inline entry entries[tag_count];
+    static inline std::atomic<size_t> total_bytes{0};
+    static inline size_t budget_bytes = 0;
+};
+
+// Tags the allocations a thread makes while it is alive; scopes nest.
+class memory_scope {
+  public:
+    explicit memory_scope(mem_tag tag) : previous(active) { active = tag; }
+    ~memory_scope() { active = previous; }
+
+    memory_scope(const memory_scope&) = delete;
+    memory_scope& operator=(const memory_scope&) = delete;
+
+    static mem_tag current() { return active; }
+
+  private:
+    mem_tag previous;
+    static inline thread_local mem_tag active = mem_tag::other;
+};
+
+// Standard allocator that charges its tag in the ledger. With allocate_shared, the charge covers
+// the shared_ptr control block as well as the object.
+template <typename T>
+class tracking_allocator {
+  public:
+    using value_type = T;
+
+    tracking_allocator() : tag(memory_scope::current()) {}
+    explicit tracking_allocator(mem_tag tag) : tag(tag) {}
+    template <typename U>
+    tracking_allocator(const tracking_allocator<U>& other) : tag(other.tag) {}
+
+    T* allocate(size_t n) {
+        memory_ledger::charge(tag, n * sizeof(T));
+        try {
+            return std::allocator<T>().allocate(n);
+        } catch (...) {
+            memory_ledger::release(tag, n * sizeof(T));
+            throw;
+        }
+    }
+
+    void deallocate(T* p, size_t n) {
+        std::allocator<T>().deallocate(p, n);
+        memory_ledger::release(tag, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const tracking_allocator<U>& other) const { return tag == other.tag; }
+    template <typename U>
+    bool operator!=(const tracking_allocator<U>& other) const { return tag != other.tag; }
+
+    mem_tag tag;
+};
+
+template <typename T>
+using tracked_vector = std::vector<T, tracking_allocator<T>>;
+
+#endif
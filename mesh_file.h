@@ -0,0 +1,207 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include "rtweekend.h"
+#include "mapped_file.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Binary mesh format (.rtmesh), written by the obj2mesh tool and read by memory-mapping it.
+//
+// A 64-byte header is followed by three arrays, each starting at a multiple of 64 bytes:
+// positions (3 floats per vertex), normals (3 floats per vertex, only if `has_normals`) and
+// indices (3 uint32 per triangle). Vertices are unique (position, normal) pairs, so one index
+// addresses both. The checksum covers every byte after the header. All values are
+// little-endian.
+
+struct mesh_header {
+    static constexpr char file_magic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0'};
+    static constexpr uint32_t current_version = 1;
+    static constexpr uint32_t has_normals = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t vertex_count;
+    uint64_t triangle_count;
+    uint64_t positions_offset;  // Byte offsets from the start of the file
+    uint64_t normals_offset;    // 0 without normals
+    uint64_t indices_offset;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(mesh_header) == 64, "mesh_header must stay 64 bytes");
+
+// Mesh arrays in memory, as the converter produces them.
+struct mesh_arrays {
+    std::vector<float> positions;
+    std::vector<float> normals;  // Empty, or one per position
+    std::vector<uint32_t> indices;
+};
+
+// Position-dependent checksum over 32-bit words (a Fletcher-style pair of running sums).
+inline uint64_t mesh_checksum(const unsigned char* data, size_t size) {
+    uint64_t a = 0, b = 0;
+    for (size_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t word;
+        std::memcpy(&word, data + i, 4);
+        a += word;
+        b += a;
+    }
+    return (b << 32) ^ a;
+}
+
+class mesh_file {
+  public:
+    static constexpr size_t alignment = 64;
+
+    // Maps and validates `path`. On failure the error is printed and valid() is false.
+    explicit mesh_file(const std::string& path, bool verify_checksum = true) : file(path) {
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << path << std::endl;
+            return;
+        }
+        open(file.data(), file.size(), verify_checksum, path);
+    }
+
+    // Validates a mesh image already in memory (for instance a cluster read from a cluster
+    // file). `data` must stay valid as long as the mesh_file is used.
+    mesh_file(const char* data, size_t size, bool verify_checksum = true) {
+        open(data, size, verify_checksum, "mesh image");
+    }
+
+    bool valid() const { return ok; }
+    size_t size() const { return length; }
+
+    size_t vertex_count() const { return size_t(header().vertex_count); }
+    size_t triangle_count() const { return size_t(header().triangle_count); }
+    bool has_normals() const { return normals != nullptr; }
+
+    point3 position(size_t vertex) const {
+        const float* p = positions + 3 * vertex;
+        return point3(p[0], p[1], p[2]);
+    }
+
+    vec3 normal(size_t vertex) const {
+        const float* n = normals + 3 * vertex;
+        return vec3(n[0], n[1], n[2]);
+    }
+
+    // The three vertex indices of `triangle`.
+    const uint32_t* triangle_indices(size_t triangle) const { return indices + 3 * triangle; }
+
+    // The file image of `mesh`.
+    static std::vector<unsigned char> serialize(const mesh_arrays& mesh) {
+        mesh_header h = {};
+        std::memcpy(h.magic, mesh_header::file_magic, sizeof(h.magic));
+        h.version = mesh_header::current_version;
+        h.flags = mesh.normals.empty() ? 0 : mesh_header::has_normals;
+        h.vertex_count = mesh.positions.size() / 3;
+        h.triangle_count = mesh.indices.size() / 3;
+
+        // Lay the arrays out after the header, each on a 64-byte boundary.
+        size_t offset = sizeof(mesh_header);
+        auto place = [&](size_t bytes) {
+            offset = (offset + alignment - 1) / alignment * alignment;
+            size_t at = offset;
+            offset += bytes;
+            return at;
+        };
+        h.positions_offset = place(mesh.positions.size() * sizeof(float));
+        h.normals_offset = mesh.normals.empty() ? 0 : place(mesh.normals.size() * sizeof(float));
+        h.indices_offset = place(mesh.indices.size() * sizeof(uint32_t));
+
+        std::vector<unsigned char> bytes(offset, 0);
+        auto copy = [&](uint64_t at, const void* data, size_t size) {
+            if (size)
+                std::memcpy(bytes.data() + at, data, size);
+        };
+        copy(h.positions_offset, mesh.positions.data(), mesh.positions.size() * sizeof(float));
+        copy(h.normals_offset, mesh.normals.data(), mesh.normals.size() * sizeof(float));
+        copy(h.indices_offset, mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+
+        h.checksum = mesh_checksum(bytes.data() + sizeof(mesh_header), bytes.size() - sizeof(mesh_header));
+        std::memcpy(bytes.data(), &h, sizeof(h));
+        return bytes;
+    }
+
+    // Writes `mesh` to `path`; returns false if the file cannot be written.
+    static bool write(const std::string& path, const mesh_arrays& mesh) {
+        auto bytes = serialize(mesh);
+        std::ofstream out(path, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(bytes.data()), std::streamsize(bytes.size()));
+        return bool(out);
+    }
+
+  private:
+    mapped_file file;
+    const char* base = nullptr;
+    size_t length = 0;
+    const float* positions = nullptr;
+    const float* normals = nullptr;
+    const uint32_t* indices = nullptr;
+    bool ok = false;
+
+    const mesh_header& header() const { return *reinterpret_cast<const mesh_header*>(base); }
+
+    void open(const char* data, size_t size, bool verify_checksum, const std::string& name) {
+        base = data;
+        length = size;
+
+        const char* problem = validate(verify_checksum);
+        if (problem) {
+            std::cerr << "Error: " << name << ": " << problem << std::endl;
+            return;
+        }
+
+        const auto* bytes = reinterpret_cast<const unsigned char*>(base);
+        positions = reinterpret_cast<const float*>(bytes + header().positions_offset);
+        if (header().flags & mesh_header::has_normals)
+            normals = reinterpret_cast<const float*>(bytes + header().normals_offset);
+        indices = reinterpret_cast<const uint32_t*>(bytes + header().indices_offset);
+        ok = true;
+    }
+
+    // Returns what is wrong with the mapped file, or null if it can be used.
+    const char* validate(bool verify_checksum) const {
+        if (length < sizeof(mesh_header))
+            return "file too small for a mesh header";
+
+        const mesh_header& h = header();
+        if (std::memcmp(h.magic, mesh_header::file_magic, sizeof(h.magic)) != 0)
+            return "not a binary mesh file";
+        if (h.version != mesh_header::current_version)
+            return "unsupported binary mesh version";
+
+        // Vertices are indexed, and primitives refer to their triangle, with 32-bit integers.
+        if (h.vertex_count > UINT32_MAX || h.triangle_count > UINT32_MAX)
+            return "too many vertices or triangles";
+
+        auto fits = [&](uint64_t offset, uint64_t count, uint64_t element_size) {
+            return offset % alignment == 0 && offset <= length
+                && count <= (length - offset) / element_size;
+        };
+        if (!fits(h.positions_offset, h.vertex_count, 3 * sizeof(float))
+            || ((h.flags & mesh_header::has_normals) && !fits(h.normals_offset, h.vertex_count, 3 * sizeof(float)))
+            || !fits(h.indices_offset, h.triangle_count, 3 * sizeof(uint32_t)))
+            return "arrays out of bounds";
+
+        const auto* bytes = reinterpret_cast<const unsigned char*>(base);
+        if (verify_checksum
+            && mesh_checksum(bytes + sizeof(mesh_header), length - sizeof(mesh_header)) != h.checksum)
+            return "checksum mismatch";
+
+        // Primitives index the arrays without bounds checks, so every index is checked once here.
+        const auto* tri = reinterpret_cast<const uint32_t*>(bytes + h.indices_offset);
+        for (uint64_t i = 0; i < 3 * h.triangle_count; i++)
+            if (tri[i] >= h.vertex_count)
+                return "vertex index out of range";
+        return nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "bvh.h"
+#include "hittable_list.h"
+#include "memory_ledger.h"
+#include "mesh_file.h"
+#include "mesh_triangle.h"
+#include "parallel.h"
+
+#include <chrono>
+#include <vector>
+
+class mesh_loader {
+  public:
+    // Duration of the last load, for reports.
+    struct load_stats {
+        size_t triangles;
+        double seconds;
+    };
+
+    static inline load_stats last_stats;
+
+    // Builds a BVH over every triangle of a mapped binary mesh, using `threads` threads (0 = every
+    // hardware thread). The primitives point into the mapping, so nothing is parsed or copied;
+    // `mesh` must outlive the result. With `arenas`, each thread's share of the primitives and
+    // each BVH subtree allocate from an arena of their own, appended to `arenas`. With
+    // `triangles`, the triangles in the tree are also added to it, so that an emissive mesh can
+    // be given to a light_list. Returns null for an invalid or empty mesh.
+    static shared_ptr<hittable> load_bvh(const mesh_file& mesh, const material* mat,
+                                         std::vector<std::unique_ptr<scene_arena>>* arenas = nullptr,
+                                         int threads = 0, hittable_list* triangles = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        if (!mesh.valid() || mesh.triangle_count() == 0)
+            return nullptr;
+
+        size_t count = mesh.triangle_count();
+        size_t parts = size_t(worker_count(threads, count / min_part_triangles));
+
+        std::vector<scene_arena*> part_arenas(parts, nullptr);
+        if (arenas) {
+            for (auto& arena : part_arenas) {
+                arenas->push_back(std::make_unique<scene_arena>());
+                arena = arenas->back().get();
+            }
+        }
+
+        std::vector<bvh_node::item> items(count);
+        parallel_for(parts, threads, [&](size_t part) {
+            memory_scope scope(mem_tag::mesh);
+            for (size_t i = count * part / parts; i < count * (part + 1) / parts; i++)
+                items[i] = bvh_node::make_item(make_in<mesh_triangle>(part_arenas[part], &mesh, uint32_t(i), mat));
+        });
+        if (triangles)
+            for (const auto& it : items)
+                triangles->add(it.object);
+
+        memory_scope scope(mem_tag::bvh);
+        auto root = bvh_node::build_parallel(items, arenas, threads);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        last_stats = {count, elapsed.count()};
+        return root;
+    }
+
+  private:
+    static constexpr size_t min_part_triangles = 65536;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef MESH_TRIANGLE_H
+#define MESH_TRIANGLE_H
+
+#include "hittable.h"
+#include "triangle.h"
+#include "triangle_block.h"
+#include "mesh_file.h"
+
+// A triangle of a memory-mapped binary mesh. It stores only the mesh and its triangle index
+// (32 bytes instead of the 240 of a triangle); vertices and normals are read from the mapped
+// arrays, which must stay mapped as long as the primitive is used.
+class mesh_triangle : public hittable {
+  public:
+    mesh_triangle(const mesh_file* mesh, uint32_t index, const material* mat)
+      : mesh(mesh), mat(mat), index(index) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        double t, u, v;
+        bool found = triangle::watertight
+                   ? triangle::watertight_test(r, ray_t, corner(0), corner(1), corner(2), t, u, v)
+                   : intersect_moller_trumbore(r, ray_t, t, u, v);
+        if (!found)
+            return false;
+
+        rec.defer(this, t, u, v);
+        return true;
+    }
+
+    // Same shading as triangle: interpolated vertex normals when the mesh has any, otherwise
+    // the geometric normal.
+    void surface(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+
+        const uint32_t* vertex = mesh->triangle_indices(index);
+        vec3 outward_normal;
+        if (mesh->has_normals()) {
+            double w = 1.0 - rec.u - rec.v;
+            outward_normal = w * mesh->normal(vertex[0]) + rec.u * mesh->normal(vertex[1])
+                           + rec.v * mesh->normal(vertex[2]);
+        }
+        if (!mesh->has_normals() || outward_normal.near_zero()) {
+            point3 v0 = corner(0);
+            outward_normal = cross(corner(1) - v0, corner(2) - v0);
+        }
+
+        rec.set_face_normal(r, unit_vector(outward_normal));
+        rec.mat = mat;
+    }
+
+    void bbox(hit_record& rec) const override {
+        aabb box0(corner(0), corner(1));
+        aabb box1(corner(0), corner(2));
+        rec.bbox_ptr = new aabb(box0, box1);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        return triangle::area_pdf(origin, direction, corner(0), corner(1), corner(2));
+    }
+
+    vec3 random(const point3& origin) const override {
+        return triangle::sample_area(corner(0), corner(1), corner(2)) - origin;
+    }
+
+    bool random_point(point3& point, vec3& normal, double& area) const override {
+        return triangle::surface_point(corner(0), corner(1), corner(2), point, normal, area);
+    }
+
+  private:
+    template <typename> friend class basic_triangle_block;
+
+    const mesh_file* mesh;
+    const material* mat;  // Owned by the scene's material_table
+    uint32_t index;
+
+    point3 corner(int i) const { return mesh->position(mesh->triangle_indices(index)[i]); }
+
+    bool intersect_moller_trumbore(const ray& r, interval ray_t, double& t, double& u, double& v)
+    const {
+        point3 v0 = corner(0);
+        return triangle::moller_trumbore(r, ray_t, v0, corner(1) - v0, corner(2) - v0, t, u, v);
+    }
+};
+
+using mesh_triangle_block = basic_triangle_block<mesh_triangle>;
+
+#endif
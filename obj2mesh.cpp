@@ -0,0 +1,91 @@
+// Converte malhas OBJ para o formato binario .rtmesh (ver mesh_file.h), que o renderizador
+// mapeia direto na memoria sem interpretar texto.
+//
+// Uso:
+//   ./obj2mesh entrada.obj saida.rtmesh
+//   ./obj2mesh --clusters N entrada.obj saida.rtclusters
+//                                         (divide a malha em clusters de ate N triangulos para
+//                                          renderizacao fora da memoria, ver clusters.h)
+//   ./obj2mesh                            (converte todos os .obj de objetos/)
+
+#include "rtweekend.h"
+
+#include "clusters.h"
+#include "mesh_file.h"
+#include "obj_loader.h"
+
+#include <chrono>
+#include <filesystem>
+
+static bool convert(const std::string& input, const std::string& output) {
+    auto start = std::chrono::steady_clock::now();
+
+    mesh_arrays mesh;
+    if (!obj_loader::load_indexed(input, mesh))
+        return false;
+
+    if (!mesh_file::write(output, mesh)) {
+        std::cerr << "ERRO: nao foi possivel escrever " << output << std::endl;
+        return false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << input << " -> " << output << ": " << mesh.indices.size() / 3 << " triangulos, "
+              << mesh.positions.size() / 3 << " vertices"
+              << (mesh.normals.empty() ? " (sem normais)" : "") << ", "
+              << std::filesystem::file_size(output) / 1024 << " KiB em "
+              << elapsed.count() * 1e3 << " ms" << std::endl;
+
+    // Confere o arquivo escrito
+    mesh_file check(output);
+    return check.valid();
+}
+
+static bool convert_clusters(size_t max_triangles, const std::string& input, const std::string& output) {
+    auto start = std::chrono::steady_clock::now();
+
+    mesh_arrays mesh;
+    if (!obj_loader::load_indexed(input, mesh))
+        return false;
+
+    if (!write_clusters(output, mesh, max_triangles)) {
+        std::cerr << "ERRO: nao foi possivel escrever " << output << std::endl;
+        return false;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    cluster_cache check(output, nullptr, 0);
+    std::cout << input << " -> " << output << ": " << mesh.indices.size() / 3 << " triangulos em "
+              << check.cluster_count() << " clusters, "
+              << std::filesystem::file_size(output) / 1024 << " KiB em "
+              << elapsed.count() * 1e3 << " ms" << std::endl;
+    return check.valid();
+}
+
+int main(int argc, char** argv) {
+    if (argc == 5 && std::string(argv[1]) == "--clusters") {
+        long max_triangles = std::atol(argv[2]);
+        if (max_triangles > 0)
+            return convert_clusters(size_t(max_triangles), argv[3], argv[4]) ? 0 : 1;
+    }
+
+    if (argc == 3)
+        return convert(argv[1], argv[2]) ? 0 : 1;
+
+    if (argc != 1) {
+        std::cerr << "Uso: " << argv[0] << " [entrada.obj saida.rtmesh]" << std::endl
+                  << "     " << argv[0] << " --clusters N entrada.obj saida.rtclusters" << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    for (const auto& entry : std::filesystem::directory_iterator("objetos")) {
+        auto input = entry.path();
+        if (input.extension() != ".obj")
+            continue;
+        auto output = input;
+        output.replace_extension(".rtmesh");
+        ok = convert(input.string(), output.string()) && ok;
+    }
+    return ok ? 0 : 1;
+}
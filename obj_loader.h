@@ -5,128 +5,416 @@
 #include "hittable_list.h"
 #include "triangle.h"
 #include "material.h"
+#include "arena.h"
+#include "memory_ledger.h"
+#include "mapped_file.h"
+#include "parallel.h"
+#include "bvh.h"
+#include "mesh_file.h"
 
-#include <fstream>
-#include <sstream>
-#include <vector>
+#include <charconv>
+#include <chrono>
+#include <cstring>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 class obj_loader {
   public:
-    static hittable_list load(const std::string& filename, shared_ptr<material> mat) {
+    // Size and duration of the last load, for throughput reports.
+    struct load_stats {
+        size_t bytes;
+        size_t triangles;
+        int chunks;
+        double seconds;
+
+        double megabytes_per_second() const { return seconds > 0 ? bytes / seconds * 1e-6 : 0; }
+    };
+
+    static inline load_stats last_stats;
+
+    // Files are split into chunks of at least this size for parallel loading.
+    static constexpr size_t min_chunk_bytes = size_t(1) << 20;
+
+    // Triangles are allocated in `arena` when one is given. They are charged to the mesh tag of
+    // the memory ledger, and the vertex arrays, which only live during the load, to I/O.
+    //
+    // The file is memory-mapped and scanned in place: no line is copied and numbers are read
+    // with std::from_chars, so nothing is allocated per line.
+    static hittable_list load(const std::string& filename, const material* mat,
+                              scene_arena* arena = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        memory_scope scope(mem_tag::mesh);
         hittable_list result;
-        std::vector<point3> vertices;
-        std::vector<vec3> normals;
-        std::ifstream file(filename);
 
+        mapped_file file(filename);
         if (!file.is_open()) {
             std::cerr << "Error: Could not open file " << filename << std::endl;
             return result;
         }
 
-        std::string line;
-        while (std::getline(file, line)) {
-            // Remove leading/trailing whitespace
-            line = trim(line);
+        std::vector<chunk> chunks = split(file, 1);
+        element_arrays elements;
+        count_elements(chunks[0]);
+        elements.resize(chunks);
+        read_elements(chunks[0], elements);
+        read_faces(chunks[0], elements, [&](const face_vertex& a, const face_vertex& b, const face_vertex& c) {
+            result.add(make_triangle(elements, a, b, c, mat, arena));
+        });
 
-            if (line.empty() || line[0] == '#') {
-                continue; // Skip empty lines and comments
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        last_stats = {file.size(), result.objects.size(), 1, elapsed.count()};
+        return result;
+    }
+
+    // Loads a mesh straight into a BVH using `threads` threads (0 = every hardware thread).
+    //
+    // The file is cut into line-aligned chunks. Vertex and normal lines are counted and read per
+    // chunk in parallel; once all are in place, the chunks' faces become triangles and their
+    // BVH build items (with bounds) in parallel, and bvh_node::build_parallel builds the tree
+    // from them. The tree is the same as a serial build over load()'s triangles. With `arenas`,
+    // every chunk and subtree allocates from an arena of its own, appended to `arenas`. With
+    // `triangles`, the triangles in the tree are also added to it, so that an emissive mesh can
+    // be given to a light_list. Returns null when the file has no triangles.
+    static shared_ptr<hittable> load_bvh(const std::string& filename, const material* mat,
+                                         std::vector<std::unique_ptr<scene_arena>>* arenas = nullptr,
+                                         int threads = 0, hittable_list* triangles = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+
+        mapped_file file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << filename << std::endl;
+            return nullptr;
+        }
+
+        std::vector<chunk> chunks = split(file, worker_count(threads, file.size() / min_chunk_bytes));
+        size_t chunk_count = chunks.size();
+
+        // Element counts per chunk give every chunk its global index range, which resolves
+        // relative (negative) indices across chunk boundaries.
+        parallel_for(chunk_count, threads, [&](size_t i) { count_elements(chunks[i]); });
+
+        element_arrays elements;
+        elements.resize(chunks);
+        parallel_for(chunk_count, threads, [&](size_t i) { read_elements(chunks[i], elements); });
+
+        std::vector<scene_arena*> chunk_arenas(chunk_count, nullptr);
+        if (arenas) {
+            for (auto& arena : chunk_arenas) {
+                arenas->push_back(std::make_unique<scene_arena>());
+                arena = arenas->back().get();
+            }
+        }
+
+        std::vector<std::vector<bvh_node::item>> chunk_items(chunk_count);
+        parallel_for(chunk_count, threads, [&](size_t i) {
+            memory_scope scope(mem_tag::mesh);
+            read_faces(chunks[i], elements, [&](const face_vertex& a, const face_vertex& b, const face_vertex& c) {
+                chunk_items[i].push_back(bvh_node::make_item(make_triangle(elements, a, b, c, mat, chunk_arenas[i])));
+            });
+        });
+
+        std::vector<bvh_node::item> items;
+        for (auto& part : chunk_items) {
+            items.insert(items.end(), std::make_move_iterator(part.begin()),
+                         std::make_move_iterator(part.end()));
+            part = {};
+        }
+        if (triangles)
+            for (const auto& it : items)
+                triangles->add(it.object);
+
+        memory_scope scope(mem_tag::bvh);
+        auto root = bvh_node::build_parallel(items, arenas, threads);
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        last_stats = {file.size(), items.size(), int(chunk_count), elapsed.count()};
+        return root;
+    }
+
+    // Reads an OBJ file into the indexed arrays of the binary mesh format (see mesh_file.h).
+    // Corners with the same position and normal become one vertex; normals are stored
+    // normalized, and as zero for corners without one. Returns false if the file cannot be read.
+    static bool load_indexed(const std::string& filename, mesh_arrays& mesh) {
+        mapped_file file(filename);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open file " << filename << std::endl;
+            return false;
+        }
+
+        std::vector<chunk> chunks = split(file, 1);
+        element_arrays elements;
+        count_elements(chunks[0]);
+        elements.resize(chunks);
+        read_elements(chunks[0], elements);
+
+        bool with_normals = !elements.normals.empty();
+        mesh = mesh_arrays();
+        std::unordered_map<uint64_t, uint32_t> vertex_ids;
+
+        auto vertex_id = [&](const face_vertex& corner) {
+            uint64_t key = (uint64_t(corner.v) << 32) | uint32_t(corner.n + 1);
+            auto [it, inserted] = vertex_ids.try_emplace(key, uint32_t(vertex_ids.size()));
+            if (inserted) {
+                const point3& p = elements.vertices[corner.v];
+                mesh.positions.insert(mesh.positions.end(), {float(p.x()), float(p.y()), float(p.z())});
+                if (with_normals) {
+                    vec3 n = corner.n >= 0 ? unit_vector(elements.normals[corner.n]) : vec3(0,0,0);
+                    mesh.normals.insert(mesh.normals.end(), {float(n.x()), float(n.y()), float(n.z())});
+                }
+            }
+            return it->second;
+        };
+
+        read_faces(chunks[0], elements, [&](const face_vertex& a, const face_vertex& b, const face_vertex& c) {
+            mesh.indices.insert(mesh.indices.end(), {vertex_id(a), vertex_id(b), vertex_id(c)});
+        });
+        return true;
+    }
+
+  private:
+    // A line-aligned slice of the file, with the global index of its first vertex and normal.
+    struct chunk {
+        const char* begin;
+        const char* end;
+        size_t vertex_count = 0, normal_count = 0;
+        size_t first_vertex = 0, first_normal = 0;
+    };
+
+    // Vertex positions and normals of the whole file, filled in by every chunk in parallel.
+    struct element_arrays {
+        tracked_vector<point3> vertices{tracking_allocator<point3>(mem_tag::io)};
+        tracked_vector<vec3> normals{tracking_allocator<vec3>(mem_tag::io)};
+
+        // Assigns each chunk its range of the arrays and sizes them.
+        void resize(std::vector<chunk>& chunks) {
+            size_t v = 0, n = 0;
+            for (auto& c : chunks) {
+                c.first_vertex = v;
+                c.first_normal = n;
+                v += c.vertex_count;
+                n += c.normal_count;
             }
+            vertices.resize(v);
+            normals.resize(n);
+        }
+    };
 
-            std::istringstream iss(line);
-            std::string type;
-            iss >> type;
+    // Indices of one face corner, 0-based once resolved; -1 when absent or out of range.
+    struct face_vertex {
+        long v = -1;
+        long n = -1;
+    };
 
-            if (type == "v") {
+    // Cuts the file into `count` pieces, each ending just after a newline.
+    static std::vector<chunk> split(const mapped_file& file, int count) {
+        std::vector<chunk> chunks;
+        const char* begin = file.data();
+        const char* end = begin + file.size();
+        for (int i = 1; i <= count; i++) {
+            const char* cut = i == count ? end : file.data() + file.size() * i / count;
+            if (cut < begin)
+                cut = begin;
+            while (cut < end && cut[-1] != '\n')
+                cut++;
+            if (cut > begin || i == count)
+                chunks.push_back({begin, cut});
+            begin = cut;
+        }
+        return chunks;
+    }
+
+    // Calls fn(s, line_end) for every line of the chunk that is not blank or a comment, with `s`
+    // at its first non-blank character.
+    template <typename Function>
+    static void for_each_line(const chunk& c, Function&& fn) {
+        const char* p = c.begin;
+        while (p < c.end) {
+            const char* line_end = static_cast<const char*>(std::memchr(p, '\n', size_t(c.end - p)));
+            if (!line_end)
+                line_end = c.end;
+
+            const char* s = skip_spaces(p, line_end);
+            p = line_end + 1;
+
+            if (s == line_end || *s == '#')
+                continue; // Skip empty lines and comments
+
+            fn(s, line_end);
+        }
+    }
+
+    static void count_elements(chunk& c) {
+        for_each_line(c, [&](const char* s, const char* line_end) {
+            if (keyword(s, line_end, "v"))
+                c.vertex_count++;
+            else if (keyword(s, line_end, "vn"))
+                c.normal_count++;
+        });
+    }
+
+    static void read_elements(const chunk& c, element_arrays& elements) {
+        size_t v = c.first_vertex, n = c.first_normal;
+        for_each_line(c, [&](const char* s, const char* line_end) {
+            if (keyword(s, line_end, "v")) {
                 // Vertex position
-                double x, y, z;
-                iss >> x >> y >> z;
-                vertices.push_back(point3(x, y, z));
+                double x = 0, y = 0, z = 0;
+                parse_real(s, line_end, x);
+                parse_real(s, line_end, y);
+                parse_real(s, line_end, z);
+                elements.vertices[v++] = point3(x, y, z);
             }
-            else if (type == "vn") {
+            else if (keyword(s, line_end, "vn")) {
                 // Vertex normal
-                double x, y, z;
-                iss >> x >> y >> z;
-                normals.push_back(vec3(x, y, z));
+                double x = 0, y = 0, z = 0;
+                parse_real(s, line_end, x);
+                parse_real(s, line_end, y);
+                parse_real(s, line_end, z);
+                elements.normals[n++] = vec3(x, y, z);
             }
-            else if (type == "f") {
-                // Face (we support triangulated faces)
-                std::vector<int> v_indices;
-                std::vector<int> n_indices;
-                std::string vertex_str;
-
-                while (iss >> vertex_str) {
-                    // Handle formats: v, v/vt, v//vn, v/vt/vn
-                    int v_index = std::stoi(split_face_index(vertex_str, 0));
-                    int n_index = -1;
-                    
-                    // Try to get normal index (could be at position 2 if v//vn, or position 1 if v/vn)
-                    std::string n_str = split_face_index(vertex_str, 2);
-                    if (n_str.empty()) {
-                        n_str = split_face_index(vertex_str, 1);
-                    }
-                    if (!n_str.empty()) {
-                        try {
-                            n_index = std::stoi(n_str) - 1; // OBJ indices are 1-based
-                        } catch (...) {
-                            n_index = -1;
-                        }
-                    }
-                    
-                    v_indices.push_back(v_index - 1); // OBJ indices are 1-based
-                    n_indices.push_back(n_index);
-                }
+        });
+    }
 
-                // Triangulate if necessary (assume triangles or quads)
-                for (size_t i = 1; i + 1 < v_indices.size(); i++) {
-                    int idx0 = v_indices[0];
-                    int idx1 = v_indices[i];
-                    int idx2 = v_indices[i + 1];
-
-                    if (idx0 >= 0 && idx0 < (int)vertices.size() &&
-                        idx1 >= 0 && idx1 < (int)vertices.size() &&
-                        idx2 >= 0 && idx2 < (int)vertices.size()) {
-                        
-                        // Create triangle with optional smooth normals
-                        result.add(make_shared<triangle>(
-                            vertices[idx0],
-                            vertices[idx1],
-                            vertices[idx2],
-                            mat,
-                            n_indices[0] >= 0 && n_indices[0] < (int)normals.size() ? unit_vector(normals[n_indices[0]]) : vec3(0,0,0),
-                            n_indices[i] >= 0 && n_indices[i] < (int)normals.size() ? unit_vector(normals[n_indices[i]]) : vec3(0,0,0),
-                            n_indices[i+1] >= 0 && n_indices[i+1] < (int)normals.size() ? unit_vector(normals[n_indices[i+1]]) : vec3(0,0,0)
-                        ));
-                    }
-                }
+    // Calls emit(a, b, c) with the resolved corners of every triangle of the chunk's faces.
+    template <typename Emit>
+    static void read_faces(const chunk& part, const element_arrays& elements, Emit&& emit) {
+        const auto& vertices = elements.vertices;
+        const auto& normals = elements.normals;
+        tracked_vector<face_vertex> face(tracking_allocator<face_vertex>(mem_tag::io));
+
+        // Elements defined so far, counting from the start of the file, for relative indices.
+        size_t v_seen = part.first_vertex, n_seen = part.first_normal;
+
+        for_each_line(part, [&](const char* s, const char* line_end) {
+            if (keyword(s, line_end, "v")) {
+                v_seen++;
+                return;
             }
-        }
+            if (keyword(s, line_end, "vn")) {
+                n_seen++;
+                return;
+            }
+            if (!keyword(s, line_end, "f"))
+                return;
 
-        file.close();
-        return result;
+            // Face: v, v/vt, v//vn or v/vt/vn per vertex
+            face.clear();
+            face_vertex fv;
+            while (parse_face_vertex(s, line_end, fv)) {
+                fv.v = resolve(fv.v, v_seen, vertices.size());
+                fv.n = resolve(fv.n, n_seen, normals.size());
+                face.push_back(fv);
+            }
+
+            // Triangulate as a fan (triangles, quads and convex polygons)
+            for (size_t i = 1; i + 1 < face.size(); i++) {
+                const face_vertex& a = face[0];
+                const face_vertex& b = face[i];
+                const face_vertex& c = face[i + 1];
+
+                if (a.v < 0 || b.v < 0 || c.v < 0)
+                    continue;
+
+                emit(a, b, c);
+            }
+        });
     }
 
-  private:
-    static std::string trim(const std::string& str) {
-        size_t first = str.find_first_not_of(" \t\r\n");
-        if (first == std::string::npos) return "";
-        size_t last = str.find_last_not_of(" \t\r\n");
-        return str.substr(first, (last - first + 1));
+    static shared_ptr<triangle> make_triangle(const element_arrays& elements, const face_vertex& a,
+                                              const face_vertex& b, const face_vertex& c,
+                                              const material* mat, scene_arena* arena) {
+        const auto& vertices = elements.vertices;
+        const auto& normals = elements.normals;
+
+        // Create triangle with optional smooth normals
+        return make_in<triangle>(arena,
+            vertices[a.v], vertices[b.v], vertices[c.v], mat,
+            a.n >= 0 ? unit_vector(normals[a.n]) : vec3(0,0,0),
+            b.n >= 0 ? unit_vector(normals[b.n]) : vec3(0,0,0),
+            c.n >= 0 ? unit_vector(normals[c.n]) : vec3(0,0,0)
+        );
+    }
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && is_space(*p))
+            p++;
+        return p;
+    }
+
+    // Consumes `word` when it is the whole first token of the line.
+    static bool keyword(const char*& p, const char* end, const char* word) {
+        size_t n = std::strlen(word);
+        if (size_t(end - p) < n || std::memcmp(p, word, n) != 0)
+            return false;
+        if (p + n < end && !is_space(p[n]))
+            return false;
+        p += n;
+        return true;
     }
 
-    static std::string split_face_index(const std::string& vertex_str, int index) {
-        std::istringstream iss(vertex_str);
-        std::string token;
-        int count = 0;
-        
-        while (std::getline(iss, token, '/')) {
-            if (count == index) {
-                return token;
+    static bool parse_real(const char*& p, const char* end, double& value) {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+')
+            p++;  // from_chars does not accept an explicit plus sign
+        auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc())
+            return false;
+        p = next;
+        return true;
+    }
+
+    static bool parse_index(const char*& p, const char* end, long& value) {
+        auto [next, error] = std::from_chars(p, end, value);
+        if (error != std::errc())
+            return false;
+        p = next;
+        return true;
+    }
+
+    static bool parse_face_vertex(const char*& p, const char* end, face_vertex& fv) {
+        p = skip_spaces(p, end);
+        if (p == end)
+            return false;
+
+        fv = face_vertex();
+        if (!parse_index(p, end, fv.v)) {
+            // Skip a malformed token and drop its vertex.
+            while (p < end && !is_space(*p))
+                p++;
+            fv.v = 0;
+            return true;
+        }
+
+        if (p < end && *p == '/') {
+            p++;
+            long vt;
+            parse_index(p, end, vt);  // Texture coordinates are not used
+            if (p < end && *p == '/') {
+                p++;
+                if (!parse_index(p, end, fv.n))
+                    fv.n = 0;
+            } else {
+                fv.n = 0;  // v/vt: no normal
             }
-            count++;
+        } else {
+            fv.n = 0;
         }
-        
-        return "";
+
+        while (p < end && !is_space(*p))
+            p++;
+        return true;
+    }
+
+    // Maps an OBJ index onto [0, count), or -1. Positive indices are 1-based, negative ones
+    // count back from the `seen` elements defined before the face. Zero, the "absent" marker
+    // above, maps to -1.
+    static long resolve(long index, size_t seen, size_t count) {
+        long resolved = index > 0 ? index - 1 : long(seen) + index;
+        if (index == 0 || resolved < 0 || resolved >= long(count))
+            return -1;
+        return resolved;
     }
 };
 
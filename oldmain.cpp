@@ -15,12 +15,13 @@
 
 int main() {
     hittable_list world;
+    material_table materials;
 
-    auto material_ground = make_shared<lambertian>(color(0.8, 0.8, 0.0));
-    auto material_center = make_shared<lambertian>(color(0.1, 0.2, 0.5));
-    auto material_left   = make_shared<dielectric>(1.50);
-    auto material_bubble = make_shared<dielectric>(1.00 / 1.50);
-    auto material_right  = make_shared<metal>(color(0.8, 0.6, 0.2), 1.0);
+    auto material_ground = materials.add<lambertian>(color(0.8, 0.8, 0.0));
+    auto material_center = materials.add<lambertian>(color(0.1, 0.2, 0.5));
+    auto material_left   = materials.add<dielectric>(1.50);
+    auto material_bubble = materials.add<dielectric>(1.00 / 1.50);
+    auto material_right  = materials.add<metal>(color(0.8, 0.6, 0.2), 1.0);
 
     world.add(make_shared<sphere>(point3( 0.0, -101, -1.0), 100.0, material_ground));
     world.add(make_shared<sphere>(point3( 0.0,    0.0, -1.2),   1, material_center));
@@ -0,0 +1,53 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of threads to use for `jobs` independent jobs. A request of 0 means one thread per
+// hardware thread.
+inline int worker_count(int requested, size_t jobs) {
+    int threads = requested > 0 ? requested : int(std::thread::hardware_concurrency());
+    threads = std::min<size_t>(std::max(threads, 1), std::max<size_t>(jobs, 1));
+    return threads;
+}
+
+// Calls fn(i) for every i in [0, count) on `threads` threads (see worker_count), which pull
+// indices from a shared counter; the calling thread is one of them. If a call throws, the
+// remaining indices are skipped and the first exception is rethrown once every thread is done.
+template <typename Function>
+void parallel_for(size_t count, int threads, Function&& fn) {
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < count && !failed; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error)
+                    error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int n = 1; n < worker_count(threads, count); n++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+#endif
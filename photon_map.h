@@ -0,0 +1,241 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "hittable.h"
+#include "light_list.h"
+#include "material.h"
+#include "memory_ledger.h"
+#include "onb.h"
+#include "parallel.h"
+#include "sampler.h"
+#include "warp.h"
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Caustic photon map (after Jensen, "Realistic Image Synthesis Using Photon Mapping").
+//
+// Light that reaches a diffuse surface only through specular() surfaces (a polished metal, a
+// glass sphere) forms caustics, which paths traced from the camera almost never find: from
+// the diffuse surface they would have to bounce off the specular one straight into a light.
+// Here photons are traced the other way, from the lights, and the ones that land on a diffuse
+// surface after at least one specular bounce are stored. The radiance of a caustic is then
+// estimated from the density of photons around a point.
+//
+// Photons are kept in a hashed grid with cells twice the gather radius, so the photons
+// within the radius of any point are in the 8 cells around it.
+class photon_map {
+  public:
+    struct photon {
+        float position[3];
+        float direction[3];  // Unit direction of travel
+        float power[3];
+    };
+
+    // Traces `emitted` photons from `lights` through `world`, on `threads` threads. Photons
+    // draw their random numbers from a `sampling` sequence scrambled by `seed`, one sample per
+    // photon. A `radius` of 0 picks one from how the photons spread, so that a gather finds
+    // about 50 of them.
+    photon_map(const hittable& world, const light_list& lights, size_t emitted, int max_bounces,
+               double radius, sampler_type sampling, uint32_t seed, int threads) {
+        const size_t chunk = 4096;
+        size_t chunks = (emitted + chunk - 1) / chunk;
+        std::vector<tracked_vector<photon>> found(chunks, tracked_vector<photon>(tracking_allocator<photon>(mem_tag::other)));
+
+        parallel_for(chunks, threads, [&](size_t c) {
+            auto photon_sampler = sampler::make(sampling, seed);
+            sampler::scope active_sampler(photon_sampler.get());
+            size_t end = std::min(emitted, (c + 1) * chunk);
+            for (size_t i = c * chunk; i < end; i++) {
+                photon_sampler->start(0, 0, int(i));
+                trace(world, lights, emitted, max_bounces, found[c]);
+            }
+        });
+
+        size_t count = 0;
+        for (const auto& part : found)
+            count += part.size();
+        tracked_vector<photon> unsorted{tracking_allocator<photon>(mem_tag::other)};
+        unsorted.reserve(count);
+        for (auto& part : found) {
+            unsorted.insert(unsorted.end(), part.begin(), part.end());
+            part = tracked_vector<photon>(tracking_allocator<photon>(mem_tag::other));
+        }
+
+        gather_radius = radius > 0 ? radius : automatic_radius(unsorted);
+        build_grid(unsorted);
+    }
+
+    size_t size() const { return photons.size(); }
+    double radius() const { return gather_radius; }
+
+    // Caustic radiance that the surface at `rec` reflects back along `r_in`, from the photons
+    // within the gather radius. `attenuation` is what the material's scatter() returned there,
+    // so attenuation * scattering_pdf / cosine is its BSDF. Photons are weighted by a cone
+    // filter, which keeps the edges of caustics sharper than a flat disc.
+    color estimate(const ray& r_in, const hit_record& rec, const color& attenuation) const {
+        if (photons.empty())
+            return color(0,0,0);
+
+        double r2 = gather_radius * gather_radius;
+        int base[3];
+        for (int a = 0; a < 3; a++)
+            base[a] = int(std::floor(rec.p[a] * inverse_cell - 0.5));
+
+        // Distinct cells can share a bucket; visit each bucket once.
+        uint32_t visited[8];
+        int visited_count = 0;
+        color sum(0,0,0);
+        for (int c = 0; c < 8; c++) {
+            uint32_t bucket = hash(base[0] + (c & 1), base[1] + ((c >> 1) & 1), base[2] + (c >> 2));
+            bool seen = false;
+            for (int k = 0; k < visited_count; k++)
+                seen = seen || visited[k] == bucket;
+            if (seen)
+                continue;
+            visited[visited_count++] = bucket;
+
+            for (uint32_t i = cell_start[bucket]; i < cell_start[bucket + 1]; i++) {
+                const photon& p = photons[i];
+                vec3 offset(p.position[0] - rec.p.x(), p.position[1] - rec.p.y(), p.position[2] - rec.p.z());
+                double d2 = offset.length_squared();
+                if (d2 > r2)
+                    continue;
+
+                vec3 incoming(-p.direction[0], -p.direction[1], -p.direction[2]);
+                double cosine = dot(incoming, rec.normal);
+                if (cosine <= 0)
+                    continue;  // Landed on the other side of the surface
+                double pdf = rec.mat->scattering_pdf(r_in, rec, ray(rec.p, incoming));
+                double weight = (1 - std::sqrt(d2 / r2)) * pdf / cosine;
+                sum += weight * color(p.power[0], p.power[1], p.power[2]);
+            }
+        }
+
+        // The cone filter integrates to pi r^2 / 3 over the disc.
+        return attenuation * sum * (3 / (pi * r2));
+    }
+
+  private:
+    tracked_vector<photon> photons{tracking_allocator<photon>(mem_tag::other)};     // Sorted by bucket
+    tracked_vector<uint32_t> cell_start{tracking_allocator<uint32_t>(mem_tag::other)};  // Buckets + 1 offsets
+    uint32_t bucket_mask = 0;
+    double gather_radius = 0;
+    double inverse_cell = 0;
+
+    // Emits one photon and follows it through specular surfaces until it lands on a diffuse
+    // one. Each emitted photon carries 1 / emitted of the lights' power.
+    static void trace(const hittable& world, const light_list& lights, size_t emitted,
+                      int max_bounces, tracked_vector<photon>& out) {
+        point3 origin;
+        vec3 normal;
+        double area;
+        const hittable* light;
+        if (!lights.random_point(origin, normal, area, light))
+            return;
+        vec3 direction = onb(normal).transform(cosine_hemisphere(sample_2d()));
+
+        // The light's emission towards `direction`, from a ray that comes back to the point.
+        ray back(origin + direction, -direction);
+        hit_record light_rec;
+        if (!light->hit(back, interval(0.5, 1.5), light_rec))
+            return;
+        light_rec.complete(back);
+        color power = light_rec.mat->emitted(back, light_rec) * (pi * area / double(emitted));
+        if (power.near_zero())
+            return;
+
+        ray r(origin, direction);
+        for (int bounce = 0; bounce < max_bounces; bounce++) {
+            if (auto s = sampler::current())
+                s->start_bounce(bounce + 1);  // The emission used the first bounce's dimensions
+
+            hit_record rec;
+            if (!world.hit(r, interval(0.001, infinity), rec))
+                return;
+            rec.complete(r);
+
+            if (!rec.mat->specular()) {
+                if (bounce > 0 && rec.mat->has_scattering_pdf()) {
+                    vec3 d = unit_vector(r.direction());
+                    out.push_back({{float(rec.p.x()), float(rec.p.y()), float(rec.p.z())},
+                                   {float(d.x()), float(d.y()), float(d.z())},
+                                   {float(power.x()), float(power.y()), float(power.z())}});
+                }
+                return;
+            }
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return;
+
+            // Russian roulette keeps the power of surviving photons from fading.
+            double survival = std::fmin(1.0, std::fmax(attenuation.x(), std::fmax(attenuation.y(), attenuation.z())));
+            if (survival <= 0 || sample_1d() >= survival)
+                return;
+            power = power * attenuation / survival;
+            r = ray(scattered.origin(), scattered.direction());
+        }
+    }
+
+    // A radius that holds about 50 photons where they spread evenly: the area the photons
+    // cover is estimated by counting the cells of a fine grid that any of them falls in.
+    static double automatic_radius(const tracked_vector<photon>& unsorted) {
+        if (unsorted.empty())
+            return 1;
+
+        aabb bounds;
+        for (const auto& p : unsorted) {
+            point3 q(p.position[0], p.position[1], p.position[2]);
+            bounds = aabb(bounds, aabb(q, q));
+        }
+        double extent = std::fmax(bounds.x.size(), std::fmax(bounds.y.size(), bounds.z.size()));
+        if (extent <= 0)
+            return 1;
+
+        double cell = extent / 256;
+        std::unordered_set<uint64_t> occupied;
+        for (const auto& p : unsorted) {
+            uint64_t x = uint64_t((p.position[0] - bounds.x.min) / cell);
+            uint64_t y = uint64_t((p.position[1] - bounds.y.min) / cell);
+            uint64_t z = uint64_t((p.position[2] - bounds.z.min) / cell);
+            occupied.insert(x | (y << 21) | (z << 42));
+        }
+        double area = double(occupied.size()) * cell * cell;
+        return std::fmax(std::sqrt(50 * area / (pi * double(unsorted.size()))), 0.5 * cell);
+    }
+
+    uint32_t hash(int x, int y, int z) const {
+        return (uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u ^ uint32_t(z) * 83492791u) & bucket_mask;
+    }
+
+    // Sorts the photons by bucket (a counting sort) and records where each bucket starts.
+    void build_grid(const tracked_vector<photon>& unsorted) {
+        inverse_cell = 1 / (2 * gather_radius);
+        uint32_t buckets = 1;
+        while (buckets < 2 * unsorted.size() && buckets < (1u << 30))
+            buckets <<= 1;
+        bucket_mask = buckets - 1;
+
+        auto bucket_of = [&](const photon& p) {
+            return hash(int(std::floor(p.position[0] * inverse_cell)),
+                        int(std::floor(p.position[1] * inverse_cell)),
+                        int(std::floor(p.position[2] * inverse_cell)));
+        };
+
+        cell_start.assign(size_t(buckets) + 1, 0);
+        for (const auto& p : unsorted)
+            cell_start[bucket_of(p) + 1]++;
+        for (uint32_t b = 0; b < buckets; b++)
+            cell_start[b + 1] += cell_start[b];
+
+        photons.resize(unsorted.size());
+        tracked_vector<uint32_t> next(cell_start.begin(), cell_start.end() - 1, tracking_allocator<uint32_t>(mem_tag::other));
+        for (const auto& p : unsorted)
+            photons[next[bucket_of(p)]++] = p;
+    }
+};
+
+#endif
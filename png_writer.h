@@ -0,0 +1,380 @@
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include "memory_ledger.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// PNG output encoded in horizontal bands of rows.
+//
+// Each band is filtered and deflated independently: its first row only uses filters that do
+// not look at the row above, and its deflate data ends with an empty stored block (a "sync
+// flush") instead of a final block, which leaves it byte aligned. Bands compressed by different
+// threads can then simply be concatenated, one IDAT chunk per band, into a single zlib stream
+// whose Adler-32 is combined from the per-band checksums. Bands can be added in any order while
+// the image is still being produced; each is written to the file as soon as every band above
+// it has been.
+class png_stream {
+  public:
+    png_stream(const std::string& path, int width, int height, int band_rows)
+      : out(path, std::ios::binary), width(width), height(height), band_rows(band_rows),
+        pending(size_t(band_count())) {
+        static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        out.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+
+        tracked_vector<unsigned char> header{tracking_allocator<unsigned char>(mem_tag::io)};
+        put_u32(header, uint32_t(width));
+        put_u32(header, uint32_t(height));
+        header.insert(header.end(), {8, 2, 0, 0, 0});  // 8 bits, RGB, deflate, no interlace
+        write_chunk("IHDR", header);
+    }
+
+    png_stream(const png_stream&) = delete;
+    png_stream& operator=(const png_stream&) = delete;
+
+    bool is_open() const { return out.is_open(); }
+    int band_count() const { return (height + band_rows - 1) / band_rows; }
+
+    // Encodes band `band` (rows [band * band_rows, ...) of the image) from tightly packed RGB8
+    // rows. May be called from several threads at once, with bands in any order.
+    void add_band(int band, const unsigned char* rgb) {
+        int rows = std::min(band_rows, height - band * band_rows);
+        size_t row_bytes = 3 * size_t(width);
+
+        tracked_vector<unsigned char> filtered{tracking_allocator<unsigned char>(mem_tag::io)};
+        filtered.resize(rows * (row_bytes + 1));
+        for (int y = 0; y < rows; y++) {
+            const unsigned char* prior = y > 0 ? rgb + (y - 1) * row_bytes : nullptr;
+            filter_row(rgb + y * row_bytes, prior, row_bytes, &filtered[y * (row_bytes + 1)]);
+        }
+
+        encoded_band result;
+        if (band == 0)
+            result.data.insert(result.data.end(), {0x78, 0x01});  // zlib header: deflate, 32K window
+        deflate(filtered.data(), filtered.size(), result.data);
+        result.adler = adler32(1, filtered.data(), filtered.size());
+        result.length = filtered.size();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        pending[band] = std::move(result);
+        pending[band].ready = true;
+        while (next_band < pending.size() && pending[next_band].ready) {
+            encoded_band& next = pending[next_band];
+            write_chunk("IDAT", next.data);
+            adler = adler32_combine(adler, next.adler, next.length);
+            next = encoded_band();
+            next_band++;
+        }
+    }
+
+    // Ends the zlib stream and the file once every band has been added. Returns false if a band
+    // is missing or the file could not be written.
+    bool finish() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (next_band != pending.size())
+            return false;
+
+        // Final empty stored block, then the Adler-32 of all the filtered rows.
+        tracked_vector<unsigned char> tail{tracking_allocator<unsigned char>(mem_tag::io)};
+        tail.insert(tail.end(), {0x01, 0x00, 0x00, 0xff, 0xff});
+        put_u32(tail, adler);
+        write_chunk("IDAT", tail);
+        write_chunk("IEND", tracked_vector<unsigned char>{tracking_allocator<unsigned char>(mem_tag::io)});
+        out.flush();
+        return bool(out);
+    }
+
+    // Writes a whole RGB8 image, encoding its bands on `threads` threads (0 = every hardware
+    // thread).
+    static bool write(const std::string& path, int width, int height, const unsigned char* rgb,
+                      int threads = 0, int band_rows = 32) {
+        png_stream png(path, width, height, band_rows);
+        if (!png.is_open())
+            return false;
+        parallel_for(size_t(png.band_count()), threads, [&](size_t band) {
+            png.add_band(int(band), rgb + band * band_rows * 3 * size_t(width));
+        });
+        return png.finish();
+    }
+
+  private:
+    struct encoded_band {
+        tracked_vector<unsigned char> data{tracking_allocator<unsigned char>(mem_tag::io)};
+        uint32_t adler = 1;
+        size_t length = 0;  // Filtered bytes the data decompresses to
+        bool ready = false;
+    };
+
+    std::ofstream out;
+    int width, height, band_rows;
+    std::mutex mutex;
+    std::vector<encoded_band> pending;
+    size_t next_band = 0;
+    uint32_t adler = 1;
+
+    static void put_u32(tracked_vector<unsigned char>& bytes, uint32_t value) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            bytes.push_back(static_cast<unsigned char>(value >> shift));
+    }
+
+    void write_chunk(const char* type, const tracked_vector<unsigned char>& data) {
+        unsigned char length[4] = {
+            static_cast<unsigned char>(data.size() >> 24), static_cast<unsigned char>(data.size() >> 16),
+            static_cast<unsigned char>(data.size() >> 8), static_cast<unsigned char>(data.size())
+        };
+        uint32_t crc = crc32(crc32(0, reinterpret_cast<const unsigned char*>(type), 4), data.data(), data.size());
+        unsigned char check[4] = {
+            static_cast<unsigned char>(crc >> 24), static_cast<unsigned char>(crc >> 16),
+            static_cast<unsigned char>(crc >> 8), static_cast<unsigned char>(crc)
+        };
+
+        out.write(reinterpret_cast<const char*>(length), 4);
+        out.write(type, 4);
+        out.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+        out.write(reinterpret_cast<const char*>(check), 4);
+    }
+
+    // Picks the filter with the smallest sum of absolute (signed) residuals, the usual PNG
+    // heuristic. Without a prior row only None and Sub are allowed.
+    static void filter_row(const unsigned char* row, const unsigned char* prior, size_t bytes,
+                           unsigned char* out) {
+        thread_local std::vector<unsigned char> candidate;
+        candidate.resize(bytes);
+
+        long best_cost = -1;
+        for (int type = 0; type < (prior ? 5 : 2); type++) {
+            long cost;
+            switch (type) {
+                case 0: cost = apply_filter<0>(row, prior, bytes, candidate.data()); break;
+                case 1: cost = apply_filter<1>(row, prior, bytes, candidate.data()); break;
+                case 2: cost = apply_filter<2>(row, prior, bytes, candidate.data()); break;
+                case 3: cost = apply_filter<3>(row, prior, bytes, candidate.data()); break;
+                default: cost = apply_filter<4>(row, prior, bytes, candidate.data()); break;
+            }
+            if (best_cost < 0 || cost < best_cost) {
+                best_cost = cost;
+                out[0] = static_cast<unsigned char>(type);
+                std::copy(candidate.begin(), candidate.end(), out + 1);
+            }
+        }
+    }
+
+    // Writes the residuals of one filter type and returns their cost.
+    template <int type>
+    static long apply_filter(const unsigned char* row, const unsigned char* prior, size_t bytes,
+                             unsigned char* out) {
+        constexpr size_t bpp = 3;
+        long cost = 0;
+        for (size_t i = 0; i < bytes; i++) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = type >= 2 ? prior[i] : 0;
+            int c = type == 4 && i >= bpp ? prior[i - bpp] : 0;
+            int predictor = 0;
+            if (type == 1)
+                predictor = a;
+            else if (type == 2)
+                predictor = b;
+            else if (type == 3)
+                predictor = (a + b) / 2;
+            else if (type == 4) {
+                int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+            }
+            out[i] = static_cast<unsigned char>(row[i] - predictor);
+            cost += std::abs(int(static_cast<signed char>(out[i])));
+        }
+        return cost;
+    }
+
+    // Deflate with the fixed Huffman codes and hash-chain LZ77 matching (one step of lazy
+    // matching), ending in a sync flush rather than a final block.
+    static void deflate(const unsigned char* data, size_t n, tracked_vector<unsigned char>& out) {
+        constexpr int hash_bits = 15;
+        constexpr size_t window = 32768;
+        constexpr int max_chain = 16;
+        constexpr int max_match = 258;
+
+        uint32_t bits = 0;
+        int bit_count = 0;
+        auto put = [&](uint32_t value, int count) {
+            bits |= value << bit_count;
+            bit_count += count;
+            while (bit_count >= 8) {
+                out.push_back(static_cast<unsigned char>(bits));
+                bits >>= 8;
+                bit_count -= 8;
+            }
+        };
+        // Huffman codes are packed starting from their most significant bit.
+        auto put_code = [&](uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; i++)
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            put(reversed, length);
+        };
+        auto put_symbol = [&](int symbol) {
+            if (symbol < 144)
+                put_code(0x30 + symbol, 8);
+            else if (symbol < 256)
+                put_code(0x190 + symbol - 144, 9);
+            else if (symbol < 280)
+                put_code(symbol - 256, 7);
+            else
+                put_code(0xc0 + symbol - 280, 8);
+        };
+
+        static const int length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                            35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const int length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                             3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const int distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                              193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                              6145, 8193, 12289, 16385, 24577};
+        static const int distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                               6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        auto put_match = [&](int length, int distance) {
+            int l = int(std::upper_bound(length_base, length_base + 29, length) - length_base) - 1;
+            put_symbol(257 + l);
+            put(uint32_t(length - length_base[l]), length_extra[l]);
+            int d = int(std::upper_bound(distance_base, distance_base + 30, distance) - distance_base) - 1;
+            put_code(uint32_t(d), 5);
+            put(uint32_t(distance - distance_base[d]), distance_extra[d]);
+        };
+
+        std::vector<int32_t> head(size_t(1) << hash_bits, -1);
+        std::vector<int32_t> prev(n);
+        auto hash = [&](size_t i) {
+            uint32_t v = data[i] | (uint32_t(data[i + 1]) << 8) | (uint32_t(data[i + 2]) << 16);
+            return (v * 2654435761u) >> (32 - hash_bits);
+        };
+        auto insert = [&](size_t i) {
+            if (i + 2 < n) {
+                uint32_t h = hash(i);
+                prev[i] = head[h];
+                head[h] = int32_t(i);
+            }
+        };
+        auto longest_match = [&](size_t i, int& distance) {
+            if (i + 2 >= n)
+                return 0;
+            int limit = int(std::min<size_t>(max_match, n - i));
+            int best = 0;
+            int32_t candidate = head[hash(i)];
+            for (int depth = 0; candidate >= 0 && i - size_t(candidate) <= window && depth < max_chain; depth++) {
+                int length = 0;
+                while (length < limit && data[candidate + length] == data[i + length])
+                    length++;
+                if (length > best) {
+                    best = length;
+                    distance = int(i - size_t(candidate));
+                    if (length == limit)
+                        break;
+                }
+                candidate = prev[candidate];
+            }
+            return best >= 3 ? best : 0;
+        };
+
+        put(0, 1);  // Not the final block
+        put(1, 2);  // Fixed Huffman codes
+        size_t i = 0;
+        int length = 0, distance = 0;
+        bool searched = false;  // Whether length and distance already hold the match at i
+        while (i < n) {
+            if (!searched)
+                length = longest_match(i, distance);
+            searched = false;
+
+            // Lazy matching: a literal is cheaper if the next position starts a longer match.
+            if (length > 0 && length < max_match) {
+                int next_distance = 0;
+                int next_length = longest_match(i + 1, next_distance);
+                if (next_length > length) {
+                    put_symbol(data[i]);
+                    insert(i);
+                    i++;
+                    length = next_length;
+                    distance = next_distance;
+                    searched = true;
+                    continue;
+                }
+            }
+            if (length == 0) {
+                put_symbol(data[i]);
+                insert(i);
+                i++;
+                continue;
+            }
+
+            put_match(length, distance);
+            for (int k = 0; k < length; k++)
+                insert(i + k);
+            i += size_t(length);
+        }
+        put_symbol(256);  // End of block
+
+        // Sync flush: an empty stored block, which ends on a byte boundary.
+        put(0, 3);
+        if (bit_count > 0)
+            put(0, 8 - bit_count);
+        out.insert(out.end(), {0x00, 0x00, 0xff, 0xff});
+    }
+
+    static uint32_t crc32(uint32_t crc, const unsigned char* data, size_t n) {
+        static const auto table = [] {
+            std::vector<uint32_t> t(256);
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+            return t;
+        }();
+
+        crc = ~crc;
+        for (size_t i = 0; i < n; i++)
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    static constexpr uint32_t adler_base = 65521;
+
+    static uint32_t adler32(uint32_t adler, const unsigned char* data, size_t n) {
+        uint32_t a = adler & 0xffff, b = adler >> 16;
+        while (n > 0) {
+            size_t block = std::min<size_t>(n, 5552);  // Largest run that cannot overflow b
+            n -= block;
+            for (size_t i = 0; i < block; i++) {
+                a += *data++;
+                b += a;
+            }
+            a %= adler_base;
+            b %= adler_base;
+        }
+        return a | (b << 16);
+    }
+
+    // Adler-32 of two byte runs joined, from their checksums and the length of the second.
+    static uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_length) {
+        uint32_t remainder = uint32_t(second_length % adler_base);
+        uint32_t a = first & 0xffff;
+        uint32_t b = uint32_t((uint64_t(remainder) * a) % adler_base);
+        a += (second & 0xffff) + adler_base - 1;
+        b += (first >> 16) + (second >> 16) + adler_base - remainder;
+        if (a >= adler_base) a -= adler_base;
+        if (a >= adler_base) a -= adler_base;
+        if (b >= 2 * adler_base) b -= 2 * adler_base;
+        if (b >= adler_base) b -= adler_base;
+        return a | (b << 16);
+    }
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
 #include <iostream>
 #include <cstdlib>
@@ -14,6 +15,17 @@
 using std::make_shared;
 using std::shared_ptr;
 
+// Precision
+
+// Scalar type of the BVH bounds and packed leaf triangles. Define RT_FLOAT_TRAVERSAL to store
+// them in float: half the memory traffic and twice the SIMD lanes, with conservative tests and
+// a double-precision refinement of the final hit.
+#ifdef RT_FLOAT_TRAVERSAL
+using traversal_real = float;
+#else
+using traversal_real = double;
+#endif
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -26,8 +38,10 @@ inline double degrees_to_radians(double degrees) {
 }
 
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
+    // One generator per thread, each with its own seed; the first thread keeps the default seed.
+    static std::atomic<unsigned> next_seed(std::mt19937::default_seed);
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    static thread_local std::mt19937 generator(next_seed++);
     return distribution(generator);
 }
 
@@ -0,0 +1,406 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <vector>
+
+// Sources of the random numbers a path consumes. Every pixel sample asks for the same sequence
+// of dimensions: two for the position inside the pixel, two for the lens, and then a fixed
+// budget per bounce (scatter direction, light choice, light position, guiding, Russian
+// roulette).
+// A low-discrepancy sampler hands out points of a stratified sequence for each dimension, so
+// the samples of one pixel cover every dimension more evenly than independent random numbers
+// and the error falls faster with the sample count.
+//
+// Dimensions past a bounce's budget, and bounces past what a sequence supports, fall back to
+// random_double().
+
+struct sample2 {
+    double u, v;
+};
+
+enum class sampler_type { independent, halton, sobol, blue_noise };
+
+class sampler {
+  public:
+    static constexpr int camera_dimensions = 4;  // Pixel position and lens position
+    static constexpr int bounce_dimensions = 12;
+
+    explicit sampler(uint32_t seed) : seed(seed) {}
+    virtual ~sampler() = default;
+
+    // Starts sample `index` of pixel (x, y), at the camera dimensions.
+    void start(int x, int y, int index) {
+        px = uint32_t(x);
+        py = uint32_t(y);
+        sample_index = uint32_t(index);
+        dimension = 0;
+        limit = camera_dimensions;
+    }
+
+    // Moves to the dimensions reserved for bounce `bounce` of the current path.
+    void start_bounce(int bounce) {
+        dimension = camera_dimensions + bounce * bounce_dimensions;
+        limit = dimension + bounce_dimensions;
+    }
+
+    double get_1d() {
+        if (dimension >= limit)
+            return random_double();
+        return value_1d(dimension++);
+    }
+
+    sample2 get_2d() {
+        if (dimension + 2 > limit) {
+            dimension = limit;
+            return {random_double(), random_double()};
+        }
+        auto s = value_2d(dimension);
+        dimension += 2;
+        return s;
+    }
+
+    // The sampler of the calling thread, or null outside a render.
+    static sampler* current() { return active; }
+
+    // Makes a sampler the current one of the calling thread while it is alive.
+    class scope {
+      public:
+        explicit scope(sampler* s) : previous(active) { active = s; }
+        ~scope() { active = previous; }
+        scope(const scope&) = delete;
+        scope& operator=(const scope&) = delete;
+
+      private:
+        sampler* previous;
+    };
+
+    static std::unique_ptr<sampler> make(sampler_type type, uint32_t seed = 0);
+
+  protected:
+    uint32_t seed;
+    uint32_t px = 0, py = 0;
+    uint32_t sample_index = 0;
+
+    virtual double value_1d(int dimension) = 0;
+    virtual sample2 value_2d(int dimension) = 0;
+
+    // Integer hashes (lowbias32), for decorrelating pixels and dimensions.
+    static uint32_t hash(uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x7feb352dU;
+        x ^= x >> 15;
+        x *= 0x846ca68bU;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static uint32_t hash(uint32_t a, uint32_t b) { return hash(a ^ hash(b)); }
+    static uint32_t hash(uint32_t a, uint32_t b, uint32_t c) { return hash(a ^ hash(b ^ hash(c))); }
+
+    static double to_unit(uint32_t x) {
+        return x * 0x1p-32;  // Never reaches 1
+    }
+
+  private:
+    int dimension = 0;
+    int limit = 0;
+    static inline thread_local sampler* active = nullptr;
+};
+
+// Draws from the current thread's sampler, or independently outside a render.
+inline double sample_1d() {
+    auto s = sampler::current();
+    return s ? s->get_1d() : random_double();
+}
+
+inline sample2 sample_2d() {
+    auto s = sampler::current();
+    if (s)
+        return s->get_2d();
+    double u = random_double();
+    return {u, random_double()};
+}
+
+// Plain Monte Carlo: every dimension independent.
+class independent_sampler : public sampler {
+  public:
+    using sampler::sampler;
+
+  protected:
+    double value_1d(int) override { return random_double(); }
+    sample2 value_2d(int) override {
+        double u = random_double();
+        return {u, random_double()};
+    }
+};
+
+// The Halton sequence, with dimension d the radical inverse in the d-th prime base. Digits are
+// scrambled by a fixed random permutation per dimension, since in the large bases the first
+// samples would otherwise crowd at the start of [0, 1), and every dimension is then shifted
+// toroidally per pixel (Cranley-Patterson rotation).
+class halton_sampler : public sampler {
+  public:
+    using sampler::sampler;
+
+  protected:
+    double value_1d(int dimension) override {
+        if (dimension >= int(std::size(primes)))
+            return random_double();
+        double x = scrambled_radical_inverse(dimension, sample_index)
+                 + to_unit(hash(hash(px, py, seed), uint32_t(dimension)));
+        return x < 1 ? x : x - 1;
+    }
+
+    sample2 value_2d(int dimension) override {
+        double u = value_1d(dimension);
+        return {u, value_1d(dimension + 1)};
+    }
+
+  private:
+    static constexpr uint32_t primes[] = {
+          2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+         59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311,
+    };
+
+    // Digit permutations, one per dimension. They keep 0 in place, so the infinitely many
+    // leading zeros of an index still add nothing.
+    static const std::vector<std::vector<uint16_t>>& permutations() {
+        static const auto tables = [] {
+            std::vector<std::vector<uint16_t>> tables;
+            std::mt19937 generator(1);
+            for (auto base : primes) {
+                std::vector<uint16_t> digits(base);
+                for (uint32_t d = 0; d < base; d++)
+                    digits[d] = uint16_t(d);
+                std::shuffle(digits.begin() + 1, digits.end(), generator);
+                tables.push_back(std::move(digits));
+            }
+            return tables;
+        }();
+        return tables;
+    }
+
+    static double scrambled_radical_inverse(int dimension, uint32_t index) {
+        uint32_t base = primes[dimension];
+        const auto& digits = permutations()[dimension];
+        double inverse_base = 1.0 / base, scale = inverse_base, x = 0;
+        while (index > 0) {
+            x += digits[index % base] * scale;
+            index /= base;
+            scale *= inverse_base;
+        }
+        return x;
+    }
+};
+
+// Padded Sobol: every pair of dimensions is the first two dimensions of the Sobol sequence,
+// Owen scrambled with its own seed, with the sample index shuffled by another scramble so the
+// pairs are not correlated with each other (Burley 2020, "Practical Hash-based Owen
+// Scrambling"). Every power-of-two prefix of a pixel's samples stays stratified in both
+// dimensions of a pair.
+class sobol_sampler : public sampler {
+  public:
+    using sampler::sampler;
+
+  protected:
+    double value_1d(int dimension) override {
+        uint32_t dimension_seed = hash(pixel_seed(), uint32_t(dimension));
+        uint32_t index = owen_scramble(sample_index, dimension_seed);
+        return to_unit(owen_scramble(sobol(index, 0), hash(dimension_seed, 1)));
+    }
+
+    sample2 value_2d(int dimension) override {
+        return scrambled_pair(sample_index, hash(pixel_seed(), uint32_t(dimension)));
+    }
+
+    uint32_t pixel_seed() const { return hash(px, py, seed); }
+
+    static sample2 scrambled_pair(uint32_t sample, uint32_t pair_seed) {
+        uint32_t index = owen_scramble(sample, pair_seed);
+        return {to_unit(owen_scramble(sobol(index, 0), hash(pair_seed, 1))),
+                to_unit(owen_scramble(sobol(index, 1), hash(pair_seed, 2)))};
+    }
+
+  private:
+    // The first two Sobol dimensions: van der Corput, and the one generated by x + 1.
+    static uint32_t sobol(uint32_t index, int dimension) {
+        if (dimension == 0)
+            return reverse_bits(index);
+        uint32_t x = 0;
+        for (uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                x ^= v;
+        return x;
+    }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+        x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+        x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Nested uniform scrambling in base 2: each bit is flipped depending on a hash of the bits
+    // above it. The Laine-Karras style hash works on reversed bits, from the low end up.
+    static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cU;
+        x ^= x * 0xb82f1e52U;
+        x ^= x * 0xc7afe638U;
+        x ^= x * 0x8d22f6e6U;
+        return reverse_bits(x);
+    }
+};
+
+// A 64x64 tileable blue-noise mask, every value in [0, 1) appearing once, made with the
+// void-and-cluster method (Ulichney 1993). Built once, on first use.
+class blue_noise_mask {
+  public:
+    static constexpr int size = 64;
+
+    static const blue_noise_mask& instance() {
+        static const blue_noise_mask mask;
+        return mask;
+    }
+
+    double at(uint32_t x, uint32_t y) const {
+        return values[(y % size) * size + (x % size)];
+    }
+
+  private:
+    static constexpr int count = size * size;
+    std::vector<double> values;
+    std::vector<double> kernel;  // Toroidal Gaussian by offset
+    std::vector<double> energy;
+    std::vector<char> pattern;
+
+    blue_noise_mask() : values(count), kernel(count), energy(count), pattern(count, 0) {
+        const double sigma = 1.5;
+        for (int dy = 0; dy < size; dy++) {
+            for (int dx = 0; dx < size; dx++) {
+                int ox = std::min(dx, size - dx), oy = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(ox * ox + oy * oy) / (2 * sigma * sigma));
+            }
+        }
+
+        // Initial binary pattern: a tenth of the pixels at random, then repeatedly move the
+        // point in the tightest cluster to the largest void until that changes nothing.
+        std::mt19937 generator(1993);
+        int ones = count / 10;
+        for (int placed = 0; placed < ones;) {
+            int i = int(generator() % count);
+            if (!pattern[i]) {
+                toggle(i);
+                placed++;
+            }
+        }
+        while (true) {
+            int cluster = extreme(true);
+            toggle(cluster);
+            int void_ = extreme(false);
+            if (void_ == cluster) {
+                toggle(cluster);
+                break;
+            }
+            toggle(void_);
+        }
+        auto initial = pattern;
+        auto initial_energy = energy;
+
+        // Ranks below the initial pattern: remove tightest clusters one by one.
+        std::vector<int> rank(count);
+        for (int r = ones - 1; r >= 0; r--) {
+            int i = extreme(true);
+            toggle(i);
+            rank[i] = r;
+        }
+
+        // Ranks above it: fill the largest voids one by one.
+        pattern = initial;
+        energy = initial_energy;
+        for (int r = ones; r < count; r++) {
+            int i = extreme(false);
+            toggle(i);
+            rank[i] = r;
+        }
+
+        for (int i = 0; i < count; i++)
+            values[i] = (rank[i] + 0.5) / count;
+        kernel = {};
+        energy = {};
+        pattern = {};
+    }
+
+    void toggle(int i) {
+        pattern[i] = !pattern[i];
+        double sign = pattern[i] ? 1 : -1;
+        int x = i % size, y = i / size;
+        for (int py = 0; py < size; py++) {
+            int dy = (py - y + size) % size;
+            for (int px = 0; px < size; px++) {
+                int dx = (px - x + size) % size;
+                energy[py * size + px] += sign * kernel[dy * size + dx];
+            }
+        }
+    }
+
+    // The set pixel with the highest energy (tightest cluster), or the unset pixel with the
+    // lowest (largest void).
+    int extreme(bool set) const {
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            if (bool(pattern[i]) != set)
+                continue;
+            if (best < 0 || (set ? energy[i] > energy[best] : energy[i] < energy[best]))
+                best = i;
+        }
+        return best;
+    }
+};
+
+// Blue-noise dithered sampling (Georgiev and Fajardo 2016): every pixel walks the same
+// scrambled Sobol sequence, shifted toroidally by the blue-noise mask, with the mask offset
+// differently for each dimension. Pixel errors then come out as high-frequency noise, which
+// reads as less noisy at low sample counts and filters away easily.
+class blue_noise_sampler : public sobol_sampler {
+  public:
+    using sobol_sampler::sobol_sampler;
+
+  protected:
+    double value_1d(int dimension) override {
+        return value_2d(dimension).u;
+    }
+
+    sample2 value_2d(int dimension) override {
+        auto s = scrambled_pair(sample_index, hash(seed, uint32_t(dimension)));
+        return {shift(s.u, uint32_t(2 * dimension)), shift(s.v, uint32_t(2 * dimension + 1))};
+    }
+
+  private:
+    double shift(double x, uint32_t dimension) const {
+        uint32_t offset = hash(seed, dimension, 0x9e3779b9U);
+        x += blue_noise_mask::instance().at(px + (offset & 0xffff), py + (offset >> 16));
+        return x < 1 ? x : x - 1;
+    }
+};
+
+inline std::unique_ptr<sampler> sampler::make(sampler_type type, uint32_t seed) {
+    switch (type) {
+        case sampler_type::halton: return std::make_unique<halton_sampler>(seed);
+        case sampler_type::sobol: return std::make_unique<sobol_sampler>(seed);
+        case sampler_type::blue_noise: return std::make_unique<blue_noise_sampler>(seed);
+        default: return std::make_unique<independent_sampler>(seed);
+    }
+}
+
+#endif
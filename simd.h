@@ -0,0 +1,91 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "rtweekend.h"
+
+#include <type_traits>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+// Helpers shared by the packed BVH leaves (triangle_block, sphere_set). Each leaf stores one
+// 256-bit register worth of primitives in structure-of-arrays form: 4 doubles or 8 floats.
+
+template <typename T>
+constexpr int simd_width = int(32 / sizeof(T));
+
+// Slack on the per-lane tests. It is an absolute margin on barycentric coordinates, which lie
+// in [0, 1] whatever the size of the triangle, and is scaled by |t| on the ray interval (see
+// widen_for_lanes) and by the h^2 term of sphere_set's discriminant. Zero in double, where the
+// lane tests are the exact scalar tests; in float the leaves refine candidates in double.
+template <typename T>
+constexpr T lane_tolerance = std::is_same_v<T, float> ? T(1e-5) : T(0);
+
+// Converts a ray interval to lane precision, loosened by the lane tolerance so rounding never
+// culls a true hit.
+template <typename T>
+inline void widen_for_lanes(const interval& ray_t, T& t_min, T& t_max) {
+    t_min = T(ray_t.min);
+    t_max = T(ray_t.max);
+    if constexpr (lane_tolerance<T> != 0) {
+        t_min -= std::fabs(t_min) * lane_tolerance<T>;
+        if (std::isfinite(t_max))
+            t_max += std::fabs(t_max) * lane_tolerance<T>;
+    }
+}
+
+#if defined(__AVX__)
+// Thin wrappers so one kernel serves both lane types.
+struct avx_double {
+    using reg = __m256d;
+    static reg set1(double x) { return _mm256_set1_pd(x); }
+    static reg load(const double* p) { return _mm256_load_pd(p); }
+    static void store(double* p, reg a) { _mm256_store_pd(p, a); }
+    static reg add(reg a, reg b) { return _mm256_add_pd(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_pd(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_pd(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_pd(a, b); }
+    static reg sqrt(reg a) { return _mm256_sqrt_pd(a); }
+    static reg abs(reg a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+    static reg ge(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+    static reg le(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+    static reg gt(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+    static reg lt(reg a, reg b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+    static reg both(reg a, reg b) { return _mm256_and_pd(a, b); }
+    static reg select(reg mask, reg a, reg b) { return _mm256_blendv_pd(b, a, mask); }
+};
+
+struct avx_float {
+    using reg = __m256;
+    static reg set1(float x) { return _mm256_set1_ps(x); }
+    static reg load(const float* p) { return _mm256_load_ps(p); }
+    static void store(float* p, reg a) { _mm256_store_ps(p, a); }
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg sub(reg a, reg b) { return _mm256_sub_ps(a, b); }
+    static reg mul(reg a, reg b) { return _mm256_mul_ps(a, b); }
+    static reg div(reg a, reg b) { return _mm256_div_ps(a, b); }
+    static reg sqrt(reg a) { return _mm256_sqrt_ps(a); }
+    static reg abs(reg a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static reg ge(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static reg le(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static reg gt(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static reg lt(reg a, reg b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static reg both(reg a, reg b) { return _mm256_and_ps(a, b); }
+    static reg select(reg mask, reg a, reg b) { return _mm256_blendv_ps(b, a, mask); }
+};
+
+template <typename T>
+using avx_lanes = std::conditional_t<std::is_same_v<T, float>, avx_float, avx_double>;
+#endif
+
+// Index of the smallest of `n` lane distances; misses carry +infinity.
+template <typename T>
+inline int closest_lane(const T* t, int n) {
+    int best = 0;
+    for (int i = 1; i < n; i++)
+        if (t[i] < t[best]) best = i;
+    return best;
+}
+
+#endif
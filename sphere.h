@@ -4,10 +4,12 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "aabb.h"
+#include "onb.h"
+#include "warp.h"
 
 class sphere : public hittable {
   public:
-     sphere(const point3& center, double radius, shared_ptr<material> mat)
+     sphere(const point3& center, double radius, const material* mat)
       : center(center), radius(std::fmax(0,radius)), mat(mat) {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
@@ -30,23 +32,73 @@ class sphere : public hittable {
                 return false;
         }
 
-        rec.t = root;
+        rec.defer(this, root);
+        return true;
+    }
+
+    void surface(const ray& r, hit_record& rec) const override {
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
 
         rec.mat = mat;
-
-        return true;
     }
 
     void bbox(hit_record& rec) const override {
         point3 rvec(radius, radius, radius);
         rec.bbox_ptr = new aabb(center - rvec, center + rvec);
     }
+
+    // Directions towards the sphere are sampled uniformly inside the cone it subtends.
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        hit_record rec;
+        if (!this->hit(ray(origin, direction), interval(0.001, infinity), rec))
+            return 0;
+
+        auto dist_squared = (center - origin).length_squared();
+        if (dist_squared <= radius*radius)
+            return 0;
+        auto cos_theta_max = std::sqrt(1 - radius*radius/dist_squared);
+        auto solid_angle = 2*pi*(1-cos_theta_max);
+
+        return 1 / solid_angle;
+    }
+
+    vec3 random(const point3& origin) const override {
+        vec3 direction = center - origin;
+        auto distance_squared = direction.length_squared();
+        if (distance_squared <= radius*radius)
+            return uniform_sphere(sample_2d());
+        onb uvw(direction);
+        return uvw.transform(random_to_sphere(radius, distance_squared));
+    }
+
+    bool random_point(point3& point, vec3& normal, double& area) const override {
+        if (radius <= 0)
+            return false;
+        normal = uniform_sphere(sample_2d());
+        point = center + radius * normal;
+        area = 4 * pi * radius * radius;
+        return true;
+    }
+
     point3 center;
     double radius;
-    shared_ptr<material> mat;
+    const material* mat;  // Owned by the scene's material_table
+
+  private:
+    static vec3 random_to_sphere(double radius, double distance_squared) {
+        auto s = sample_2d();
+        auto r1 = s.u;
+        auto r2 = s.v;
+        auto z = 1 + r2*(std::sqrt(1-radius*radius/distance_squared) - 1);
+
+        auto phi = 2*pi*r1;
+        auto x = std::cos(phi) * std::sqrt(1-z*z);
+        auto y = std::sin(phi) * std::sqrt(1-z*z);
+
+        return vec3(x, y, z);
+    }
 };
 
 #endif
\ No newline at end of file
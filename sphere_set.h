@@ -0,0 +1,164 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "hittable.h"
+#include "sphere.h"
+#include "aabb.h"
+#include "simd.h"
+
+#include <vector>
+
+// A BVH leaf holding up to `width` spheres with their centers and radii in structure-of-arrays
+// form. One ray is tested against every lane at once and only the closest sphere is recorded.
+//
+// As with triangle_block, float lanes are conservative and their candidates are re-tested in
+// double unless `refine` is turned off.
+class sphere_set : public hittable {
+  public:
+    using real = traversal_real;
+
+    static constexpr int width = simd_width<real>;
+
+    static inline bool refine = true;
+    static inline std::atomic<size_t> built{0};  // Sets constructed so far, for memory reports
+
+    sphere_set(const std::vector<shared_ptr<sphere>>& spheres) : count(int(spheres.size())) {
+        for (int i = 0; i < width; i++) {
+            // Unused lanes repeat the last sphere, so they can only ever report a duplicate of
+            // a real hit.
+            const auto& s = spheres[i < count ? i : count - 1];
+            prims[i] = s;
+            cx[i] = real(s->center.x());
+            cy[i] = real(s->center.y());
+            cz[i] = real(s->center.z());
+            rr[i] = real(s->radius * s->radius);
+        }
+        built++;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        alignas(32) real t[width];
+        intersect(r, ray_t, t);
+
+        if constexpr (std::is_same_v<real, float>) {
+            if (refine)
+                return refine_hit(r, ray_t, t, rec);
+        }
+
+        int best = closest_lane(t, width);
+        if (t[best] == std::numeric_limits<real>::infinity())
+            return false;
+
+        rec.defer(prims[best].get(), t[best]);
+        return true;
+    }
+
+    void bbox(hit_record& rec) const override {
+        aabb box;
+        for (int i = 0; i < count; i++) {
+            point3 rvec(prims[i]->radius, prims[i]->radius, prims[i]->radius);
+            box = aabb(box, aabb(prims[i]->center - rvec, prims[i]->center + rvec));
+        }
+        rec.bbox_ptr = new aabb(box);
+    }
+
+  private:
+    alignas(32) real cx[width], cy[width], cz[width];
+    alignas(32) real rr[width];  // Squared radii
+    shared_ptr<sphere> prims[width];
+    int count;
+
+    static constexpr real tolerance = lane_tolerance<real>;
+
+    bool refine_hit(const ray& r, interval ray_t, const real* t, hit_record& rec) const {
+        int best = -1;
+        hit_record temp_rec;
+        for (int i = 0; i < width; i++) {
+            if (t[i] == std::numeric_limits<real>::infinity())
+                continue;
+
+            if (prims[i]->hit(r, ray_t, temp_rec)) {
+                best = i;
+                ray_t.max = temp_rec.t;
+            }
+        }
+
+        if (best < 0)
+            return false;
+
+        rec.defer(prims[best].get(), ray_t.max);
+        return true;
+    }
+
+#if defined(__AVX__)
+    void intersect(const ray& r, interval ray_t, real* t_out) const {
+        using S = avx_lanes<real>;
+        using reg = typename S::reg;
+
+        const real ddx = real(r.direction().x()), ddy = real(r.direction().y()), ddz = real(r.direction().z());
+        reg dx = S::set1(ddx), dy = S::set1(ddy), dz = S::set1(ddz);
+        reg a = S::set1(ddx*ddx + ddy*ddy + ddz*ddz);
+
+        // oc = center - origin
+        reg ox = S::sub(S::load(cx), S::set1(real(r.origin().x())));
+        reg oy = S::sub(S::load(cy), S::set1(real(r.origin().y())));
+        reg oz = S::sub(S::load(cz), S::set1(real(r.origin().z())));
+
+        reg h = S::add(S::add(S::mul(dx, ox), S::mul(dy, oy)), S::mul(dz, oz));
+        reg c = S::sub(S::add(S::add(S::mul(ox, ox), S::mul(oy, oy)), S::mul(oz, oz)), S::load(rr));
+
+        reg hh = S::mul(h, h);
+        reg disc = S::sub(hh, S::mul(a, c));
+        reg has_roots = S::ge(disc, S::mul(S::set1(-tolerance), hh));
+        reg sqrtd = S::sqrt(S::abs(disc));
+
+        real t_min, t_max;
+        widen_for_lanes(ray_t, t_min, t_max);
+        reg lo = S::set1(t_min), hi = S::set1(t_max);
+
+        // Nearest root in range, else the far one.
+        reg near = S::div(S::sub(h, sqrtd), a);
+        reg far  = S::div(S::add(h, sqrtd), a);
+        reg near_ok = S::both(S::gt(near, lo), S::lt(near, hi));
+        reg far_ok  = S::both(S::gt(far, lo), S::lt(far, hi));
+
+        reg inf = S::set1(std::numeric_limits<real>::infinity());
+        reg t = S::select(far_ok, far, inf);
+        t = S::select(near_ok, near, t);
+        t = S::select(has_roots, t, inf);
+
+        S::store(t_out, t);
+    }
+#else
+    void intersect(const ray& r, interval ray_t, real* t_out) const {
+        // Branch-free per lane, so the compiler can vectorize the loop with whatever SIMD width
+        // the target offers.
+        const real dx = real(r.direction().x()), dy = real(r.direction().y()), dz = real(r.direction().z());
+        const real px = real(r.origin().x()), py = real(r.origin().y()), pz = real(r.origin().z());
+        const real a = dx*dx + dy*dy + dz*dz;
+
+        real t_min, t_max;
+        widen_for_lanes(ray_t, t_min, t_max);
+
+        for (int i = 0; i < width; i++) {
+            real ox = cx[i] - px, oy = cy[i] - py, oz = cz[i] - pz;
+            real h = dx*ox + dy*oy + dz*oz;
+            real c = ox*ox + oy*oy + oz*oz - rr[i];
+
+            real disc = h*h - a*c;
+            bool has_roots = disc >= -tolerance * h*h;
+            real sqrtd = std::sqrt(std::fabs(disc));
+
+            real near = (h - sqrtd) / a;
+            real far  = (h + sqrtd) / a;
+            bool near_ok = (near > t_min) & (near < t_max);
+            bool far_ok  = (far > t_min) & (far < t_max);
+
+            real t = near_ok ? near : (far_ok ? far : std::numeric_limits<real>::infinity());
+            t_out[i] = has_roots ? t : std::numeric_limits<real>::infinity();
+        }
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,196 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include "denoiser.h"
+#include "framebuffer.h"
+#include "memory_ledger.h"
+#include "parallel.h"
+
+#include <cmath>
+
+// Sample reuse across the frames of a camera animation (temporal accumulation, as in Schied
+// et al. 2017, "Spatiotemporal Variance-Guided Filtering").
+//
+// After each frame the history keeps every pixel's accumulated color and sample count, with
+// the distance and normal of the first surface it saw. The scene holds still while the camera
+// moves, so the next frame can tell from its own depth where each of its pixels' surface point
+// was on the previous frame's image (the motion vector), and add the samples gathered there.
+// History from pixels that saw another surface (disocclusions, silhouettes) is rejected, and
+// history colors are clipped to the range of the new frame's neighbourhood so that lighting
+// that changes with the viewpoint, like reflections, doesn't smear.
+class frame_history {
+  public:
+    // A pinhole camera: pixel (0, 0) is centered at `pixel00`, and pixel (i, j) at
+    // pixel00 + i * delta_u + j * delta_v.
+    struct view {
+        point3 center;
+        point3 pixel00;
+        vec3   delta_u, delta_v;
+    };
+
+    double depth_tolerance = 0.05;  // Relative depth difference still taken as the same surface
+    double normal_tolerance = 0.9;  // Smallest cosine between normals of the same surface
+    double clip_sigmas = 2;         // Half-width of the clipping range, in neighbourhood deviations
+
+    bool empty() const { return pixels.empty(); }
+    void clear() { pixels = tracked_vector<pixel>(tracking_allocator<pixel>(mem_tag::framebuffer)); }
+
+    // Blends the history into `image`, whose pixels hold this frame's samples only, and keeps
+    // the result for the next frame. `features` are this frame's, seen from `current`. The
+    // history counts as at most `max_samples` samples per pixel, so old samples fade out
+    // instead of blurring the image as they are resampled frame after frame. Returns the
+    // number of pixels that reused history.
+    size_t accumulate(framebuffer& image, const feature_buffer& features, const view& current,
+                      double max_samples, int threads) {
+        int w = image.width(), h = image.height();
+        if (w != width || h != height)
+            clear();
+
+        // Blended colors go to `next` first, since clipping reads this frame's neighbours.
+        tracked_vector<pixel> next(size_t(w) * h, pixel{}, tracking_allocator<pixel>(mem_tag::framebuffer));
+        std::vector<size_t> reused_rows(size_t(h), 0);
+        parallel_for(size_t(h), threads, [&](size_t row) {
+            int y = int(row);
+            for (int x = 0; x < w; x++) {
+                double samples = image.samples(x, y);
+                auto f = features.mean(x, y, samples);
+                color now = image.average(x, y);
+
+                pixel& out = next[size_t(y) * w + x];
+                out.depth = float(f.depth);
+                vec3 normal = f.normal.near_zero() ? vec3(0,0,0) : unit_vector(f.normal);
+                for (int k = 0; k < 3; k++)
+                    out.normal[k] = float(normal[k]);
+
+                color past;
+                double past_samples = 0;
+                if (!pixels.empty() && samples > 0
+                    && reproject(current, x, y, f.depth, normal, past, past_samples)) {
+                    past = clip(image, x, y, past);
+                    past_samples = std::fmin(past_samples, max_samples);
+                    now = (samples * now + past_samples * past) / (samples + past_samples);
+                    reused_rows[row]++;
+                }
+
+                for (int k = 0; k < 3; k++)
+                    out.color[k] = float(now[k]);
+                out.samples = float(samples + past_samples);
+            }
+        });
+
+        parallel_for(size_t(h), threads, [&](size_t row) {
+            for (int x = 0; x < w; x++) {
+                const pixel& p = next[row * w + x];
+                image.set_average(x, int(row), color(p.color[0], p.color[1], p.color[2]));
+            }
+        });
+
+        pixels = std::move(next);
+        width = w;
+        height = h;
+        previous = current;
+
+        size_t reused = 0;
+        for (size_t count : reused_rows)
+            reused += count;
+        return reused;
+    }
+
+  private:
+    struct pixel {
+        float color[3];   // Accumulated average
+        float samples;
+        float depth;      // 0 where the pixel saw only the sky
+        float normal[3];
+    };
+
+    tracked_vector<pixel> pixels{tracking_allocator<pixel>(mem_tag::framebuffer)};
+    int width = 0, height = 0;
+    view previous;
+
+    // The history of the surface point that pixel (x, y) of `current` sees at `depth`, from
+    // the previous image bilinearly, using only the taps that saw the same surface.
+    bool reproject(const view& current, int x, int y, double depth, const vec3& normal,
+                   color& past, double& past_samples) const {
+        vec3 direction = unit_vector(current.pixel00 + x * current.delta_u + y * current.delta_v - current.center);
+
+        // Where the point, or for the sky the direction, crosses the previous viewport.
+        vec3 seen = depth > 0 ? current.center + depth * direction - previous.center : direction;
+        vec3 to_viewport = previous.pixel00 - previous.center;
+        vec3 plane_normal = cross(previous.delta_u, previous.delta_v);
+        double along = dot(seen, plane_normal);
+        if (along == 0)
+            return false;
+        double s = dot(to_viewport, plane_normal) / along;
+        if (s <= 0)
+            return false;  // Behind the previous camera
+        vec3 offset = s * seen - to_viewport;
+        double px = dot(offset, previous.delta_u) / previous.delta_u.length_squared();
+        double py = dot(offset, previous.delta_v) / previous.delta_v.length_squared();
+        if (!(px > -1 && px < width && py > -1 && py < height))
+            return false;
+
+        double expected_depth = depth > 0 ? seen.length() : 0;
+        int x0 = int(std::floor(px)), y0 = int(std::floor(py));
+        double fx = px - x0, fy = py - y0;
+        double total = 0;
+        color sum(0,0,0);
+        double sample_sum = 0;
+        for (int tap = 0; tap < 4; tap++) {
+            int tx = x0 + (tap & 1), ty = y0 + (tap >> 1);
+            double weight = ((tap & 1) ? fx : 1 - fx) * ((tap >> 1) ? fy : 1 - fy);
+            if (weight <= 0 || tx < 0 || ty < 0 || tx >= width || ty >= height)
+                continue;
+
+            const pixel& p = pixels[size_t(ty) * width + tx];
+            if (p.samples <= 0 || !same_surface(p, expected_depth, normal))
+                continue;
+            total += weight;
+            sum += weight * color(p.color[0], p.color[1], p.color[2]);
+            sample_sum += weight * p.samples;
+        }
+
+        // A mostly rejected footprint would leave a few stretched taps; start over instead.
+        if (total < 0.25)
+            return false;
+        past = sum / total;
+        past_samples = sample_sum / total;
+        return true;
+    }
+
+    bool same_surface(const pixel& p, double expected_depth, const vec3& normal) const {
+        if (expected_depth <= 0 || p.depth <= 0)
+            return expected_depth <= 0 && p.depth <= 0;
+        if (std::fabs(p.depth - expected_depth) > depth_tolerance * expected_depth)
+            return false;
+        return p.normal[0] * normal.x() + p.normal[1] * normal.y() + p.normal[2] * normal.z() >= normal_tolerance;
+    }
+
+    // Clamps `past` to the mean plus or minus clip_sigmas deviations of this frame's 3x3
+    // neighbourhood around (x, y), channel by channel.
+    color clip(const framebuffer& image, int x, int y, const color& past) const {
+        color mean(0,0,0), square(0,0,0);
+        int count = 0;
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = x + dx, ny = y + dy;
+                if (nx < 0 || ny < 0 || nx >= image.width() || ny >= image.height() || image.samples(nx, ny) <= 0)
+                    continue;
+                color c = image.average(nx, ny);
+                mean += c;
+                square += c * c;
+                count++;
+            }
+        mean = mean / count;
+        square = square / count;
+
+        color clipped;
+        for (int k = 0; k < 3; k++) {
+            double sigma = std::sqrt(std::fmax(0.0, square[k] - mean[k] * mean[k]));
+            clipped[k] = std::clamp(past[k], mean[k] - clip_sigmas * sigma, mean[k] + clip_sigmas * sigma);
+        }
+        return clipped;
+    }
+};
+
+#endif
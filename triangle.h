@@ -4,28 +4,128 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "aabb.h"
+#include "sampler.h"
 
 class triangle : public hittable {
   public:
+    // When true, every triangle uses the watertight intersection test (Woop, Benthin and Wald,
+    // 2013) instead of Möller-Trumbore. It is slower, but rays can no longer slip through the
+    // shared edges of a closed mesh.
+    static inline bool watertight = false;
+
     // Constructor without smooth normals (compute from geometry)
-    triangle(const point3& v0, const point3& v1, const point3& v2, shared_ptr<material> mat)
-        : v0(v0), v1(v1), v2(v2), mat(mat), 
-          n0(vec3(0,0,0)), n1(vec3(0,0,0)), n2(vec3(0,0,0)), 
-          use_smooth_normals(false) {}
-    
+    triangle(const point3& v0, const point3& v1, const point3& v2, const material* mat)
+        : v0(v0), v1(v1), v2(v2), mat(mat),
+          n0(vec3(0,0,0)), n1(vec3(0,0,0)), n2(vec3(0,0,0)),
+          use_smooth_normals(false) {
+        precompute();
+    }
+
     // Constructor with smooth normals (from OBJ vn)
-    triangle(const point3& v0, const point3& v1, const point3& v2, shared_ptr<material> mat,
+    triangle(const point3& v0, const point3& v1, const point3& v2, const material* mat,
              const vec3& n0, const vec3& n1, const vec3& n2)
-        : v0(v0), v1(v1), v2(v2), mat(mat), 
+        : v0(v0), v1(v1), v2(v2), mat(mat),
           n0(n0), n1(n1), n2(n2),
-          use_smooth_normals(!(n0.length() < 0.001 && n1.length() < 0.001 && n2.length() < 0.001)) {}
+          use_smooth_normals(!(n0.length() < 0.001 && n1.length() < 0.001 && n2.length() < 0.001)) {
+        precompute();
+    }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        // Möller-Trumbore ray-triangle intersection algorithm
+        double t, u, v;
+        bool found = watertight ? intersect_watertight(r, ray_t, t, u, v)
+                                : intersect_moller_trumbore(r, ray_t, t, u, v);
+        if (!found)
+            return false;
+
+        rec.defer(this, t, u, v);
+        return true;
+    }
+
+    // Barycentric weights in the record are u for v1 and v for v2.
+    void surface(const ray& r, hit_record& rec) const override {
+        rec.p = r.at(rec.t);
+
+        // Use smooth normals if available, otherwise use the precomputed face normal
+        vec3 outward_normal;
+        if (use_smooth_normals) {
+            // Interpolate smooth normals using barycentric coordinates
+            double w = 1.0 - rec.u - rec.v;
+            outward_normal = unit_vector(w * n0 + rec.u * n1 + rec.v * n2);
+        } else {
+            outward_normal = face_normal;
+        }
+
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = mat;
+    }
+
+    void bbox(hit_record& rec) const override {
+        aabb box0(v0, v1);
+        aabb box1(v0, v2);
+        rec.bbox_ptr = new aabb(box0, box1);
+    }
+
+    // Points are sampled uniformly over the triangle's area; converted to solid angle as seen
+    // from `origin`.
+    double pdf_value(const point3& origin, const vec3& direction) const override {
+        return area_pdf(origin, direction, v0, v1, v2);
+    }
+
+    vec3 random(const point3& origin) const override {
+        return sample_area(v0, v1, v2) - origin;
+    }
+
+    bool random_point(point3& point, vec3& normal, double& area) const override {
+        return surface_point(v0, v1, v2, point, normal, area);
+    }
+
+    // Area-sampling helpers on bare vertex data, shared with mesh_triangle.
+    static double area_pdf(const point3& origin, const vec3& direction,
+                           const point3& v0, const point3& v1, const point3& v2) {
+        double t, u, v;
+        ray r(origin, direction);
+        if (!moller_trumbore(r, interval(0.001, infinity), v0, v1 - v0, v2 - v0, t, u, v))
+            return 0;
+
+        vec3 n = cross(v1 - v0, v2 - v0);
+        auto area = 0.5 * n.length();
+        auto distance_squared = t * t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, n)) / (direction.length() * n.length());
+        if (area <= 0 || cosine < 1e-8)
+            return 0;
+
+        return distance_squared / (cosine * area);
+    }
+
+    static bool surface_point(const point3& v0, const point3& v1, const point3& v2,
+                              point3& point, vec3& normal, double& area) {
+        vec3 n = cross(v1 - v0, v2 - v0);
+        area = 0.5 * n.length();
+        if (area <= 0)
+            return false;
+        normal = n / (2 * area);
+        point = sample_area(v0, v1, v2);
+        return true;
+    }
+
+    static point3 sample_area(const point3& v0, const point3& v1, const point3& v2) {
+        auto s = sample_2d();
+        auto a = s.u;
+        auto b = s.v;
+        if (a + b > 1) {
+            a = 1 - a;
+            b = 1 - b;
+        }
+        return v0 + a * (v1 - v0) + b * (v2 - v0);
+    }
+
+    // The two intersection tests on bare vertex data, shared with the primitives of mapped
+    // meshes (mesh_triangle). Both report barycentrics u for v1 and v for v2.
+    static bool moller_trumbore(const ray& r, interval ray_t, const point3& v0,
+                                const vec3& edge1, const vec3& edge2,
+                                double& t, double& u, double& v) {
         const double EPSILON = 1e-8;
-        
-        vec3 edge1 = v1 - v0;
-        vec3 edge2 = v2 - v0;
+
         vec3 ray_cross_e2 = cross(r.direction(), edge2);
         double det = dot(edge1, ray_cross_e2);
 
@@ -35,56 +135,114 @@ class triangle : public hittable {
 
         double inv_det = 1.0 / det;
         vec3 s = r.origin() - v0;
-        double u = inv_det * dot(s, ray_cross_e2);
+        u = inv_det * dot(s, ray_cross_e2);
 
         if (u < 0.0 || u > 1.0) {
             return false;
         }
 
         vec3 s_cross_e1 = cross(s, edge1);
-        double v = inv_det * dot(r.direction(), s_cross_e1);
+        v = inv_det * dot(r.direction(), s_cross_e1);
 
         if (v < 0.0 || u + v > 1.0) {
             return false;
         }
 
-        double t = inv_det * dot(edge2, s_cross_e1);
+        t = inv_det * dot(edge2, s_cross_e1);
+
+        return ray_t.surrounds(t);
+    }
+
+    static bool watertight_test(const ray& r, interval ray_t, const point3& v0, const point3& v1,
+                                const point3& v2, double& t, double& u, double& v) {
+        const vec3& dir = r.direction();
+
+        // Permute the axes so the ray direction's largest component becomes z, keeping the
+        // winding of the triangle intact.
+        int kz = max_dimension(dir);
+        int kx = (kz + 1) % 3;
+        int ky = (kx + 1) % 3;
+        if (dir[kz] < 0)
+            std::swap(kx, ky);
+
+        // Shear so the ray runs along +z from the origin.
+        double sx = dir[kx] / dir[kz];
+        double sy = dir[ky] / dir[kz];
+        double sz = 1.0 / dir[kz];
+
+        vec3 a = v0 - r.origin();
+        vec3 b = v1 - r.origin();
+        vec3 c = v2 - r.origin();
+
+        double ax = a[kx] - sx*a[kz], ay = a[ky] - sy*a[kz];
+        double bx = b[kx] - sx*b[kz], by = b[ky] - sy*b[kz];
+        double cx = c[kx] - sx*c[kz], cy = c[ky] - sy*c[kz];
+
+        // Scaled barycentrics from 2D edge functions. A ray through a shared edge evaluates the
+        // same edge function with the same operands for both triangles, so exactly one of them
+        // (or both) reports the hit.
+        double e0 = cx*by - cy*bx;
+        double e1 = ax*cy - ay*cx;
+        double e2 = bx*ay - by*ax;
 
-        if (!ray_t.surrounds(t)) {
+        if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
             return false;
-        }
 
-        rec.t = t;
-        rec.p = r.at(rec.t);
-        
-        // Use smooth normals if available, otherwise compute from geometry
-        vec3 outward_normal;
-        if (use_smooth_normals) {
-            // Interpolate smooth normals using barycentric coordinates
-            double w = 1.0 - u - v;
-            outward_normal = unit_vector(w * n0 + u * n1 + v * n2);
-        } else {
-            // Compute face normal using cross product
-            outward_normal = unit_vector(cross(edge1, edge2));
-        }
-        
-        rec.set_face_normal(r, outward_normal);
-        rec.mat = mat;
+        double det = e0 + e1 + e2;
+        if (det == 0)
+            return false;
 
+        double az = sz*a[kz], bz = sz*b[kz], cz = sz*c[kz];
+        double inv_det = 1.0 / det;
+
+        t = (e0*az + e1*bz + e2*cz) * inv_det;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        u = e1 * inv_det;
+        v = e2 * inv_det;
         return true;
     }
 
-    void bbox(hit_record& rec) const override {
-        aabb box0(v0, v1);
-        aabb box1(v0, v2);
-        rec.bbox_ptr = new aabb(box0, box1);
-    }
-    
   private:
+    template <typename> friend class basic_triangle_block;
+
     point3 v0, v1, v2;
     vec3 n0, n1, n2;  // Smooth normals for each vertex
-    shared_ptr<material> mat;
+    const material* mat;  // Owned by the scene's material_table
     bool use_smooth_normals;
+
+    // Derived at construction so the intersection tests never rebuild them per ray.
+    vec3 edge1, edge2;
+    vec3 face_normal;  // Unit geometric normal, (v1 - v0) x (v2 - v0)
+
+    void precompute() {
+        edge1 = v1 - v0;
+        edge2 = v2 - v0;
+
+        auto n = cross(edge1, edge2);
+        auto len = n.length();
+        face_normal = (len > 0) ? n / len : vec3(0,0,0);
+    }
+
+    bool intersect_moller_trumbore(const ray& r, interval ray_t, double& t, double& u, double& v)
+    const {
+        return moller_trumbore(r, ray_t, v0, edge1, edge2, t, u, v);
+    }
+
+    bool intersect_watertight(const ray& r, interval ray_t, double& t, double& u, double& v)
+    const {
+        return watertight_test(r, ray_t, v0, v1, v2, t, u, v);
+    }
+
+    const point3& corner(int i) const { return i == 0 ? v0 : (i == 1 ? v1 : v2); }
+
+    static int max_dimension(const vec3& d) {
+        auto x = std::fabs(d.x()), y = std::fabs(d.y()), z = std::fabs(d.z());
+        if (x > y && x > z)
+            return 0;
+        return (y > z) ? 1 : 2;
+    }
 };
 
 #endif
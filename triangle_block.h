@@ -0,0 +1,217 @@
+#ifndef TRIANGLE_BLOCK_H
+#define TRIANGLE_BLOCK_H
+
+#include "hittable.h"
+#include "triangle.h"
+#include "aabb.h"
+#include "simd.h"
+
+#include <vector>
+
+// A BVH leaf holding up to `width` triangles in structure-of-arrays form, so one ray is tested
+// against all of them with a single Möller-Trumbore evaluation across the lanes. Only the
+// closest lane is recorded.
+//
+// `Tri` is the primitive type: triangle, or mesh_triangle for meshes mapped from a binary file.
+// It provides corner(i) and intersect_moller_trumbore(), and befriends the block.
+//
+// Lanes are stored as `traversal_real`. In float the lane test is conservative (an absolute
+// tolerance on the barycentrics, a relative one on the ray interval) and the surviving
+// candidates are re-tested in double against the source triangles, unless `refine` is turned off.
+template <typename Tri>
+class basic_triangle_block : public hittable {
+  public:
+    using real = traversal_real;
+
+    static constexpr int width = simd_width<real>;
+
+    static inline bool refine = true;
+    static inline std::atomic<size_t> built{0};  // Blocks constructed so far, for memory reports
+
+    basic_triangle_block(const std::vector<shared_ptr<Tri>>& tris) : count(int(tris.size())) {
+        for (int i = 0; i < width; i++) {
+            // Unused lanes repeat the last triangle, so they can only ever report a duplicate of
+            // a real hit.
+            const auto& tri = tris[i < count ? i : count - 1];
+            prims[i] = tri;
+            point3 v0 = tri->corner(0);
+            vec3 edge1 = tri->corner(1) - v0;
+            vec3 edge2 = tri->corner(2) - v0;
+            v0x[i] = real(v0.x());    v0y[i] = real(v0.y());    v0z[i] = real(v0.z());
+            e1x[i] = real(edge1.x()); e1y[i] = real(edge1.y()); e1z[i] = real(edge1.z());
+            e2x[i] = real(edge2.x()); e2y[i] = real(edge2.y()); e2z[i] = real(edge2.z());
+        }
+        built++;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // The watertight test has no vectorized form; fall back to the triangles themselves.
+        if (triangle::watertight) {
+            bool hit_anything = false;
+            for (int i = 0; i < count; i++) {
+                if (prims[i]->hit(r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            }
+            return hit_anything;
+        }
+
+        alignas(32) real t[width], u[width], v[width];
+        intersect(r, ray_t, t, u, v);
+
+        if constexpr (std::is_same_v<real, float>) {
+            if (refine)
+                return refine_hit(r, ray_t, t, rec);
+        }
+
+        // Horizontal min over the lanes.
+        int best = closest_lane(t, width);
+
+        if (t[best] == std::numeric_limits<real>::infinity())
+            return false;
+
+        rec.defer(prims[best].get(), t[best], u[best], v[best]);
+        return true;
+    }
+
+    void bbox(hit_record& rec) const override {
+        aabb box;
+        for (int i = 0; i < count; i++) {
+            const auto& tri = *prims[i];
+            box = aabb(box, aabb(aabb(tri.corner(0), tri.corner(1)), aabb(tri.corner(0), tri.corner(2))));
+        }
+        rec.bbox_ptr = new aabb(box);
+    }
+
+  private:
+    alignas(32) real v0x[width], v0y[width], v0z[width];
+    alignas(32) real e1x[width], e1y[width], e1z[width];
+    alignas(32) real e2x[width], e2y[width], e2z[width];
+    shared_ptr<Tri> prims[width];
+    int count;
+
+    static constexpr real tolerance = lane_tolerance<real>;
+
+    bool refine_hit(const ray& r, interval ray_t, const real* t, hit_record& rec) const {
+        // Re-test every candidate lane in double. There is rarely more than one.
+        int best = -1;
+        double best_t = 0, best_u = 0, best_v = 0;
+        for (int i = 0; i < width; i++) {
+            if (t[i] == std::numeric_limits<real>::infinity())
+                continue;
+
+            double ti, ui, vi;
+            if (prims[i]->intersect_moller_trumbore(r, ray_t, ti, ui, vi)) {
+                best = i;
+                best_t = ti; best_u = ui; best_v = vi;
+                ray_t.max = ti;
+            }
+        }
+
+        if (best < 0)
+            return false;
+
+        rec.defer(prims[best].get(), best_t, best_u, best_v);
+        return true;
+    }
+
+#if defined(__AVX__)
+    void intersect(const ray& r, interval ray_t, real* t_out, real* u_out, real* v_out) const {
+        using S = avx_lanes<real>;
+        using reg = typename S::reg;
+
+        const reg lo = S::set1(-tolerance);
+        const reg hi = S::set1(1 + tolerance);
+
+        reg dx = S::set1(real(r.direction().x()));
+        reg dy = S::set1(real(r.direction().y()));
+        reg dz = S::set1(real(r.direction().z()));
+
+        reg ax = S::load(e1x), ay = S::load(e1y), az = S::load(e1z);
+        reg bx = S::load(e2x), by = S::load(e2y), bz = S::load(e2z);
+
+        // pvec = d x e2
+        reg px = S::sub(S::mul(dy, bz), S::mul(dz, by));
+        reg py = S::sub(S::mul(dz, bx), S::mul(dx, bz));
+        reg pz = S::sub(S::mul(dx, by), S::mul(dy, bx));
+
+        reg det = S::add(S::add(S::mul(ax, px), S::mul(ay, py)), S::mul(az, pz));
+        reg inv_det = S::div(S::set1(1), det);
+
+        // s = o - v0
+        reg sx = S::sub(S::set1(real(r.origin().x())), S::load(v0x));
+        reg sy = S::sub(S::set1(real(r.origin().y())), S::load(v0y));
+        reg sz = S::sub(S::set1(real(r.origin().z())), S::load(v0z));
+
+        reg u = S::mul(inv_det, S::add(S::add(S::mul(sx, px), S::mul(sy, py)), S::mul(sz, pz)));
+
+        // qvec = s x e1
+        reg qx = S::sub(S::mul(sy, az), S::mul(sz, ay));
+        reg qy = S::sub(S::mul(sz, ax), S::mul(sx, az));
+        reg qz = S::sub(S::mul(sx, ay), S::mul(sy, ax));
+
+        reg v = S::mul(inv_det, S::add(S::add(S::mul(dx, qx), S::mul(dy, qy)), S::mul(dz, qz)));
+        reg t = S::mul(inv_det, S::add(S::add(S::mul(bx, qx), S::mul(by, qy)), S::mul(bz, qz)));
+
+        real t_min, t_max;
+        widen_for_lanes(ray_t, t_min, t_max);
+
+        reg valid = S::ge(S::abs(det), S::set1(real(1e-8)));
+        valid = S::both(valid, S::ge(u, lo));
+        valid = S::both(valid, S::le(u, hi));
+        valid = S::both(valid, S::ge(v, lo));
+        valid = S::both(valid, S::le(S::add(u, v), hi));
+        valid = S::both(valid, S::gt(t, S::set1(t_min)));
+        valid = S::both(valid, S::lt(t, S::set1(t_max)));
+
+        t = S::select(valid, t, S::set1(std::numeric_limits<real>::infinity()));
+
+        S::store(t_out, t);
+        S::store(u_out, u);
+        S::store(v_out, v);
+    }
+#else
+    void intersect(const ray& r, interval ray_t, real* t_out, real* u_out, real* v_out) const {
+        // Branch-free per lane, so the compiler can vectorize the loop with whatever SIMD width
+        // the target offers.
+        const real dx = real(r.direction().x()), dy = real(r.direction().y()), dz = real(r.direction().z());
+        const real ox = real(r.origin().x()), oy = real(r.origin().y()), oz = real(r.origin().z());
+
+        real t_min, t_max;
+        widen_for_lanes(ray_t, t_min, t_max);
+
+        for (int i = 0; i < width; i++) {
+            real px = dy*e2z[i] - dz*e2y[i];
+            real py = dz*e2x[i] - dx*e2z[i];
+            real pz = dx*e2y[i] - dy*e2x[i];
+
+            real det = e1x[i]*px + e1y[i]*py + e1z[i]*pz;
+            real inv_det = 1 / det;
+
+            real sx = ox - v0x[i], sy = oy - v0y[i], sz = oz - v0z[i];
+            real u = inv_det * (sx*px + sy*py + sz*pz);
+
+            real qx = sy*e1z[i] - sz*e1y[i];
+            real qy = sz*e1x[i] - sx*e1z[i];
+            real qz = sx*e1y[i] - sy*e1x[i];
+
+            real v = inv_det * (dx*qx + dy*qy + dz*qz);
+            real t = inv_det * (e2x[i]*qx + e2y[i]*qy + e2z[i]*qz);
+
+            bool valid = (std::fabs(det) >= real(1e-8))
+                       & (u >= -tolerance) & (u <= 1 + tolerance)
+                       & (v >= -tolerance) & (u + v <= 1 + tolerance)
+                       & (t > t_min) & (t < t_max);
+
+            t_out[i] = valid ? t : std::numeric_limits<real>::infinity();
+            u_out[i] = u;
+            v_out[i] = v;
+        }
+    }
+#endif
+};
+
+using triangle_block = basic_triangle_block<triangle>;
+
+#endif
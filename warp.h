@@ -0,0 +1,77 @@
+#ifndef WARP_H
+#define WARP_H
+
+#include "vec3.h"
+#include "sampler.h"
+
+// Closed-form maps from the unit square to the shapes the renderer samples. Unlike rejection
+// sampling, each one consumes exactly one 2D sample and runs a fixed sequence of instructions,
+// so it keeps the stratification of a low-discrepancy sampler and never mispredicts a retry.
+//
+// Directions on a hemisphere are returned in a local frame around +z; rotate them with an onb.
+
+// Uniform point in the unit disk (z = 0), by Shirley and Chiu's concentric map, which keeps
+// neighbouring squares neighbouring and distorts areas little.
+inline vec3 uniform_disk(sample2 s) {
+    double a = 2 * s.u - 1;
+    double b = 2 * s.v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, theta;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        theta = (pi / 4) * (b / a);
+    } else {
+        r = b;
+        theta = (pi / 2) - (pi / 4) * (a / b);
+    }
+    return vec3(r * std::cos(theta), r * std::sin(theta), 0);
+}
+
+// Uniform direction on the unit sphere.
+inline vec3 uniform_sphere(sample2 s) {
+    double z = 1 - 2 * s.u;
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * s.v;
+    return vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Cosine-weighted direction on the hemisphere around +z (Malley's method: a uniform disk
+// point lifted onto the hemisphere).
+inline vec3 cosine_hemisphere(sample2 s) {
+    vec3 d = uniform_disk(s);
+    double z = std::sqrt(std::fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+    return vec3(d.x(), d.y(), z);
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta) {
+    return cos_theta <= 0 ? 0 : cos_theta / pi;
+}
+
+// GGX (Trowbridge-Reitz) distribution D of microfacet normals around +z with roughness
+// `alpha`; D(h) cos(theta_h) integrates to 1 over the hemisphere.
+inline double ggx_distribution(double cos_theta, double alpha) {
+    if (cos_theta <= 0)
+        return 0;
+    double cos2 = cos_theta * cos_theta;
+    double tan2 = (1 - cos2) / cos2;
+    double a2 = alpha * alpha;
+    double denominator = cos2 * (a2 + tan2);
+    return a2 / (pi * denominator * denominator);
+}
+
+// Microfacet normal around +z with density ggx_distribution(cos_theta) * cos_theta.
+inline vec3 ggx_normal(sample2 s, double alpha) {
+    double tan2 = alpha * alpha * s.u / (1 - s.u);
+    double cos_theta = 1 / std::sqrt(1 + tan2);
+    double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+    double phi = 2 * pi * s.v;
+    return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+inline double ggx_normal_pdf(double cos_theta, double alpha) {
+    return ggx_distribution(cos_theta, alpha) * cos_theta;
+}
+
+#endif